@@ -134,6 +134,16 @@
 #define TRY_DENSE_HEAP_START (void *) 0x800000000
 
 
+/*
+ * Maximum number of regions mapped with mem_map at the same time
+ */
+#define MAX_MAPS 4096
+
+/*
+ * Granularity of the regions mapped with mem_map
+ */
+#define MAP_PAGE_SIZE (1<<12)
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -9,23 +9,31 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
 #include "mm.h"
-#include "stree.h"
 
 /**********************
  * Constants and macros
@@ -41,8 +49,8 @@
 #define REF_ONLY 0
 #endif
 
-/* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
+/* Returns true if p is a-byte aligned */
+#define IS_ALIGNED(p, a) ((((unsigned long)(p)) % (a)) == 0)
 
 /* weights */
 typedef enum
@@ -66,25 +74,41 @@ typedef enum
 
 /*
  * Records the extent of each block's payload.
- * Organized as doubly linked list
  */
-typedef struct range_t
+typedef struct
 {
     char *lo;   /* low payload address */
     char *hi;   /* high payload address */
     long index; /* same index as free; for debugging */
-    struct range_t *next;
-    struct range_t *prev;
 } range_t;
 
+/* Number of ranges in a run */
+#define RANGE_RUN 128
+
+/*
+ * A run of ranges, sorted by lo addresses. A run that is not in use is
+ * kept in the pool of its range set, linked by next_free.
+ */
+typedef struct range_run_t
+{
+    int count; /* ranges in use */
+    struct range_run_t *next_free;
+    range_t ranges[RANGE_RUN];
+} range_run_t;
+
 /*
- * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * All information about set of ranges: the ranges are in runs, and the
+ * runs in an array sorted by their first lo address, so that a range is
+ * found by two binary searches and added or removed by moving at most a
+ * run. Runs are taken from and given back to a pool, so the ranges cost
+ * no malloc once the set has grown.
  */
 typedef struct
 {
-    range_t *list;
-    tree_t *lo_tree;
+    range_run_t **runs;     /* the runs in use, none of them empty */
+    int num_runs;           /* number of runs in use */
+    int max_runs;           /* number of runs the array has room for */
+    range_run_t *free_runs; /* pool of runs not in use */
 } range_set_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -94,11 +118,16 @@ typedef struct
     {
         ALLOC,
         FREE,
-        REALLOC
-    } type;      /* type of request */
-    long index;  /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
-} traceop_t;
+        REALLOC,
+        ALLOC_BATCH,
+        FREE_BATCH,
+        MEMALIGN
+    } type;       /* type of request */
+    int count;    /* number of ids from index on (1 unless a batch) */
+    long index;   /* index for free() to use later */
+    size_t size;  /* byte size of alloc/realloc request, or of the freed block */
+    size_t align; /* payload alignment of a memalign request */
+} traceop_t;      /* no padding, binary traces store it as it is */
 
 /* Holds the information for one trace file */
 typedef struct
@@ -112,8 +141,50 @@ typedef struct
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
+    size_t map_len;       /* length of the mapping ops is in, 0 if malloced */
 } trace_t;
 
+/*
+ * Header of a binary trace, written by mdriver -b next to the text trace
+ * and mapped by read_trace. It is followed by the num_ops requests, as
+ * traceop_t records of the build that wrote it.
+ */
+#define BIN_MAGIC "MMTRACE1"
+#define BIN_BYTE_ORDER 0x01020304
+
+typedef struct
+{
+    char magic[8];       /* BIN_MAGIC */
+    uint32_t byte_order; /* BIN_BYTE_ORDER, as the writer stored it */
+    uint32_t op_size;    /* sizeof(traceop_t) of the writer */
+    uint32_t weight;     /* weight for this trace */
+    int32_t num_ids;     /* number of alloc/realloc ids */
+    int32_t num_ops;     /* number of requests that follow */
+    uint32_t unused;
+    uint64_t data_bytes; /* Peak number of data bytes allocated */
+    char pad[24];        /* keeps the requests 64-byte aligned */
+} bin_header_t;
+
+/*
+ * Latency histograms of the requests of one type, with buckets spaced as
+ * in HdrHistogram: LAT_SUB per power of 2, so that a bucket is within
+ * 1/LAT_SUB of the times it holds
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+#define NUM_OP_TYPES (MEMALIGN + 1)
+
+typedef struct
+{
+    uint64_t counts[NUM_OP_TYPES][LAT_BUCKETS]; /* requests by time */
+    uint64_t sum[NUM_OP_TYPES];                 /* their total time */
+    uint64_t max[NUM_OP_TYPES];                 /* the slowest one */
+    uint64_t ticks;    /* counter ticks over the timed replays... */
+    double ns;         /* ... and the ns they took, to convert */
+    uint64_t overhead; /* ticks of reading the counter twice, taken off */
+} latency_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -123,6 +194,7 @@ typedef struct
 {
     trace_t *trace;
     range_set_t *ranges;
+    latency_t *latency; /* if set, eval_mm_speed times each request into it */
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -140,6 +212,10 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    size_t peak_bytes; /* peak footprint (heap + mapped) during eval_mm_util */
+    size_t end_bytes;  /* footprint left at the end of eval_mm_util */
+    size_t extends;    /* number of mem_sbrk calls that grew the heap */
+    size_t tail_waste; /* bytes past the highest payload at the heap peak */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -195,6 +271,47 @@ size_t queryGlobalSpaceUsage(void);
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* If >= 0, passed to mm_mallopt(MM_FIT_DEPTH) before the traces are run */
+static long fit_depth = -1;
+
+/* If >= 0, passed to mm_mallopt(MM_CHECK_INTERVAL) before the traces run */
+static long check_interval = -1;
+
+/* If set, batch requests are replayed as single mm_malloc/mm_free calls */
+static bool unbatch = false;
+
+/* If set, blocks are freed with mm_free_sized instead of mm_free */
+static bool sized_free = false;
+
+/* If set, the allocator statistics are printed after each trace */
+static bool print_stats = false;
+
+/* If > 0, one replay of each trace is profiled at this sampling rate */
+static long profile_rate = 0;
+
+/* If set, the trace is reduced, and the smaller trace written to this file */
+static char *reduce_file = NULL;
+
+/* If > 0, the reduced trace must keep an op slower than this many ns;
+   otherwise it must keep failing */
+static long slow_ns = 0;
+
+/* Number of candidate traces replayed at once while reducing (0: one per
+   processor) */
+static long reduce_jobs = 0;
+
+/* If > 0, each trace is also replayed on 1 up to this many threads */
+static long max_threads = 0;
+
+/* If set, each thread replays a whole copy of the trace, not a part of it */
+static bool whole_traces = false;
+
+/* If set, the latency percentiles of each request type are printed */
+static bool print_latency = false;
+
+/* If set, the binary form of each trace is written instead of running it */
+static bool write_binary = false;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -229,7 +346,8 @@ static void add_tracefile(char *trace);
 /* these functions manipulate range sets */
 static range_set_t *new_range_set();
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index);
+                      size_t align, const trace_t *trace, int opnum,
+                      int index);
 static void remove_range(range_set_t *ranges, char *lo);
 static void free_range_set(range_set_t *ranges);
 
@@ -242,6 +360,10 @@ static void randomize_block(trace_t *trace, int index);
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
 static void reinit_trace(trace_t *trace);
+static bool map_trace(trace_t *trace, stats_t *stats, const char *path,
+                      bool twin);
+static void bin_trace_name(const char *path, char *buf);
+static void write_bin_trace(const trace_t *trace, const char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -251,11 +373,22 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void replay_op(trace_t *trace, int i);
+static void eval_mm_threads(trace_t *trace, double single_tput);
+static void eval_mm_latency(speed_t *speed_params);
+static inline uint64_t lat_ticks(void);
+static inline void lat_record(latency_t *latency, int type, uint64_t ticks);
+
+/* These functions shrink a trace that fails, or has a slow request */
+static void reduce_trace(const char *tracedir, const char *filename);
+static void write_trace(const trace_t *trace, const char *path);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void print_mm_stats(const char *filename);
+static void dump_mm_profile(const char *filename);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -301,7 +434,6 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0)
@@ -332,21 +464,38 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            if (profile_rate > 0)
+                mm_mallopt(MM_PROFILE_RATE, profile_rate);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
+            if (profile_rate > 0)
+            {
+                dump_mm_profile(trace->filename);
+                mm_mallopt(MM_PROFILE_RATE, 0);
+            }
+            if (print_stats)
+                print_mm_stats(trace->filename);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
+            speed_params->latency = NULL;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (print_latency)
+                eval_mm_latency(speed_params);
+            if (max_threads > 0)
+                eval_mm_threads(trace, mm_stats[i].tput);
+            if (verbose > 1)
+            {
+                printf("Footprint: peak %zu bytes, %zu bytes at the end\n",
+                       mm_stats[i].peak_bytes, mm_stats[i].end_bytes);
+                printf("Heap extended %zu times, %zu bytes unused at the "
+                       "tail at the peak\n",
+                       mm_stats[i].extends, mm_stats[i].tail_waste);
+            }
         }
 
-#if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
-#endif
         free_trace(trace);
         free_range_set(ranges);
 
@@ -384,7 +533,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:K:P:I:R:X:j:N:hpbCOVAlDTBSMWL")) != EOF)
     {
         switch (c)
         {
@@ -445,6 +594,75 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'K': /* Bound the number of blocks compared by find_fit */
+            fit_depth = atol(optarg);
+            break;
+
+        case 'I': /* Sweep the whole heap every <k> mm_checkheap calls */
+            check_interval = atol(optarg);
+            break;
+
+        case 'B': /* Replay batch requests one block at a time */
+            unbatch = true;
+            break;
+
+        case 'S': /* Free with mm_free_sized */
+            sized_free = true;
+            break;
+
+        case 'M': /* Print the allocator statistics of each trace */
+            print_stats = true;
+            break;
+
+        case 'P': /* Profile each trace, sampling every <bytes> on average */
+            profile_rate = atol(optarg);
+            if (profile_rate <= 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'R': /* Reduce the trace, write the result to <file> */
+            reduce_file = optarg;
+            break;
+
+        case 'X': /* Reduce to a trace with a request slower than <ns> */
+            slow_ns = atol(optarg);
+            if (slow_ns <= 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'j': /* Replay <n> candidates at a time while reducing */
+            reduce_jobs = atol(optarg);
+            break;
+
+        case 'N': /* Replay each trace on 1 to <n> threads (0: CPUs) */
+            max_threads = atol(optarg);
+            if (max_threads == 0)
+                max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            if (max_threads <= 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'W': /* With -N, each thread replays the whole trace */
+            whole_traces = true;
+            break;
+
+        case 'L': /* Print the latency percentiles of each request type */
+            print_latency = true;
+            break;
+
+        case 'b': /* Write the binary form of each trace and exit */
+            write_binary = true;
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -459,7 +677,7 @@ int main(int argc, char **argv)
     if (num_global_tracefiles == 0)
     {
         int i;
-        if (sparse_mode & !run_libc)
+        if ((sparse_mode || write_binary) && !run_libc)
         {
             for (i = 0; default_giant_tracefiles[i]; i++)
                 add_tracefile(default_giant_tracefiles[i]);
@@ -473,6 +691,65 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    if (fit_depth >= 0)
+    {
+        if (!mm_mallopt(MM_FIT_DEPTH, fit_depth))
+            app_error("mm_mallopt: fit depth %ld not supported", fit_depth);
+        if (verbose)
+            printf("Fit depth: %ld%s\n", fit_depth,
+                   fit_depth == 0 ? " (best fit)" : "");
+    }
+
+    if (check_interval >= 0)
+    {
+        if (!mm_mallopt(MM_CHECK_INTERVAL, check_interval))
+            app_error("mm_mallopt: check interval %ld not supported",
+                      check_interval);
+        if (verbose)
+            printf("Check interval: %ld%s\n", check_interval,
+                   check_interval == 0 ? " (full checks)" : "");
+    }
+
+    /* Nor is it timed */
+    if (print_latency && sparse_mode)
+        app_error("-L cannot be used with sparse memory emulation\n");
+
+    /* The emulated memory of mdriver-emulate is not thread safe */
+    if (max_threads > 0 && sparse_mode)
+        app_error("-N cannot be used with sparse memory emulation\n");
+
+    /* Write the binary traces instead of grading */
+    if (write_binary)
+    {
+        if (unbatch)
+            app_error("-b cannot be used with -B\n");
+        for (int i = 0; i < num_global_tracefiles; i++)
+        {
+            stats_t stats;
+            char bin_path[MAXLINE];
+            trace_t *trace = read_trace(&stats, tracedir, global_tracefiles[i]);
+            bin_trace_name(trace->filename, bin_path);
+            if (trace->map_len != 0)
+                printf("%s is already binary\n", trace->filename);
+            else
+            {
+                write_bin_trace(trace, bin_path);
+                printf("Wrote %s\n", bin_path);
+            }
+            free_trace(trace);
+        }
+        exit(0);
+    }
+
+    /* Reduce a trace instead of grading; -s then limits each replay */
+    if (reduce_file != NULL)
+    {
+        if (num_global_tracefiles != 1)
+            app_error("-R needs exactly one trace, given with -f\n");
+        reduce_trace(tracedir, global_tracefiles[0]);
+        exit(0);
+    }
+
     /* Initialize the timeout */
     if (set_timeout > 0)
     {
@@ -764,9 +1041,9 @@ static void add_tracefile(char *trace)
 }
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range set, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
@@ -775,36 +1052,139 @@ static void add_tracefile(char *trace)
 static range_set_t *new_range_set()
 {
     range_set_t *ranges = (range_set_t *)malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    if (ranges == NULL)
+        unix_error("malloc error in new_range_set");
+    ranges->runs = NULL;
+    ranges->num_runs = 0;
+    ranges->max_runs = 0;
+    ranges->free_runs = NULL;
     return ranges;
 }
 
+/*
+ * find_run - Return the last run whose first range starts at or below lo,
+ *     -1 if there is none
+ */
+static int find_run(const range_set_t *ranges, const char *lo)
+{
+    int left = 0, right = ranges->num_runs - 1;
+
+    while (left <= right)
+    {
+        int mid = (left + right) / 2;
+        if (ranges->runs[mid]->ranges[0].lo <= lo)
+            left = mid + 1;
+        else
+            right = mid - 1;
+    }
+    return right;
+}
+
+/*
+ * find_range - Return the last range of a run that starts at or below lo,
+ *     -1 if there is none
+ */
+static int find_range(const range_run_t *run, const char *lo)
+{
+    int left = 0, right = run->count - 1;
+
+    while (left <= right)
+    {
+        int mid = (left + right) / 2;
+        if (run->ranges[mid].lo <= lo)
+            left = mid + 1;
+        else
+            right = mid - 1;
+    }
+    return right;
+}
+
+/*
+ * insert_run - Put a run from the pool (or a new one) at position k of
+ *     the runs in use, and return it
+ */
+static range_run_t *insert_run(range_set_t *ranges, int k)
+{
+    range_run_t *run = ranges->free_runs;
+
+    if (run != NULL)
+        ranges->free_runs = run->next_free;
+    else if ((run = (range_run_t *)malloc(sizeof(range_run_t))) == NULL)
+        unix_error("malloc error in insert_run");
+    run->count = 0;
+
+    if (ranges->num_runs == ranges->max_runs)
+    {
+        ranges->max_runs = ranges->max_runs ? 2 * ranges->max_runs : 16;
+        ranges->runs = (range_run_t **)realloc(
+            ranges->runs, ranges->max_runs * sizeof(range_run_t *));
+        if (ranges->runs == NULL)
+            unix_error("realloc error in insert_run");
+    }
+    memmove(&ranges->runs[k + 1], &ranges->runs[k],
+            (ranges->num_runs - k) * sizeof(range_run_t *));
+    ranges->runs[k] = run;
+    ranges->num_runs++;
+    return run;
+}
+
+/*
+ * release_run - Give run k back to the pool
+ */
+static void release_run(range_set_t *ranges, int k)
+{
+    range_run_t *run = ranges->runs[k];
+
+    memmove(&ranges->runs[k], &ranges->runs[k + 1],
+            (ranges->num_runs - k - 1) * sizeof(range_run_t *));
+    ranges->num_runs--;
+    run->next_free = ranges->free_runs;
+    ranges->free_runs = run;
+}
+
+/*
+ * merge_runs - Move the ranges of run k + 1 to the end of run k
+ */
+static void merge_runs(range_set_t *ranges, int k)
+{
+    range_run_t *run = ranges->runs[k];
+    range_run_t *next = ranges->runs[k + 1];
+
+    memcpy(&run->ranges[run->count], next->ranges,
+           next->count * sizeof(range_t));
+    run->count += next->count;
+    release_run(ranges, k + 1);
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     size bytes at addr lo, aligned to align bytes (ALIGNMENT unless
+ *     it came from mm_memalign). After checking the block for correctness,
+ *     we record its range in the range set.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index)
+                      size_t align, const trace_t *trace, int opnum,
+                      int index)
 {
     char *hi = lo + size - 1;
 
     assert(size > 0);
 
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo))
+    /* Payload addresses must be align-byte aligned */
+    if (!IS_ALIGNED(lo, align))
     {
         malloc_error(trace, opnum,
-                     "Payload address (%p) not aligned to %d bytes", lo,
-                     ALIGNMENT);
+                     "Payload address (%p) not aligned to %zu bytes", lo,
+                     align);
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or within a
+       region mapped with mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, size))
     {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -816,9 +1196,16 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE)
         return 1;
 
-    /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned)lo);
-    range_t *next = prev ? prev->next : NULL;
+    /* Find the predecessor block: range j of run k, or none if j is -1 */
+    int k = find_run(ranges, lo);
+    int j = (k >= 0) ? find_range(ranges->runs[k], lo) : -1;
+    range_t *prev = (j >= 0) ? &ranges->runs[k]->ranges[j] : NULL;
+    range_t *next = NULL;
+    if (k >= 0 && j + 1 < ranges->runs[k]->count)
+        next = &ranges->runs[k]->ranges[j + 1];
+    else if (k + 1 < ranges->num_runs)
+        next = &ranges->runs[k + 1]->ranges[0];
+
     /* See if it overlaps previous or next blocks */
     if (prev && lo <= prev->hi)
     {
@@ -834,45 +1221,68 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
                      hi, next->lo, next->hi);
         return false;
     }
+
     /*
-     * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * Everything looks OK, so remember the extent of this block after
+     * its predecessor, in the first run if it has none. A full run is
+     * split in halves first.
      */
-    range_t *p;
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->prev = prev;
-    if (prev)
-        prev->next = p;
-    else
-        ranges->list = p;
-    p->next = next;
-    if (next)
-        next->prev = p;
-    p->lo = lo;
-    p->hi = hi;
-    p->index = index;
-    tree_insert(ranges->lo_tree, (long unsigned)lo, (void *)p);
+    if (k < 0)
+    {
+        k = 0;
+        if (ranges->num_runs == 0)
+            insert_run(ranges, 0);
+    }
+    range_run_t *run = ranges->runs[k];
+    j++;
+    if (run->count == RANGE_RUN)
+    {
+        range_run_t *upper = insert_run(ranges, k + 1);
+        upper->count = RANGE_RUN / 2;
+        run->count = RANGE_RUN - upper->count;
+        memcpy(upper->ranges, &run->ranges[run->count],
+               upper->count * sizeof(range_t));
+        if (j > run->count)
+        {
+            j -= run->count;
+            run = upper;
+        }
+    }
+    memmove(&run->ranges[j + 1], &run->ranges[j],
+            (run->count - j) * sizeof(range_t));
+    run->ranges[j].lo = lo;
+    run->ranges[j].hi = hi;
+    run->ranges[j].index = index;
+    run->count++;
     return true;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Forget the range of the block whose payload starts at lo
  */
 static void remove_range(range_set_t *ranges, char *lo)
 {
-    range_t *p = (range_t *)tree_remove(ranges->lo_tree, (long unsigned)lo);
-    if (!p)
+    int k = find_run(ranges, lo);
+    if (k < 0)
         return;
-    range_t *prev = p->prev;
-    range_t *next = p->next;
-    if (prev)
-        prev->next = next;
-    else
-        ranges->list = next;
-    if (next)
-        next->prev = prev;
-    free(p);
+    range_run_t *run = ranges->runs[k];
+    int j = find_range(run, lo);
+    if (j < 0 || run->ranges[j].lo != lo)
+        return;
+
+    memmove(&run->ranges[j], &run->ranges[j + 1],
+            (run->count - j - 1) * sizeof(range_t));
+    run->count--;
+
+    /* Merge the run with a neighbour when both fit in half a run, so that
+       on average the runs stay a quarter full */
+    if (run->count == 0)
+        release_run(ranges, k);
+    else if (k + 1 < ranges->num_runs &&
+        run->count + ranges->runs[k + 1]->count <= RANGE_RUN / 2)
+        merge_runs(ranges, k);
+    else if (k > 0 && run->count + ranges->runs[k - 1]->count <= RANGE_RUN / 2)
+        merge_runs(ranges, k - 1);
 }
 
 /*
@@ -880,7 +1290,17 @@ static void remove_range(range_set_t *ranges, char *lo)
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    range_run_t *run;
+    int k;
+
+    for (k = 0; k < ranges->num_runs; k++)
+        free(ranges->runs[k]);
+    while ((run = ranges->free_runs) != NULL)
+    {
+        ranges->free_runs = run->next_free;
+        free(run);
+    }
+    free(ranges->runs);
     free(ranges);
 }
 
@@ -1001,10 +1421,14 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     trace_t *trace;
     char type[MAXLINE];
     int index;
+    int count;
     size_t size;
+    size_t align;
     int max_index = 0;
     int op_index;
+    int num_lines;
     int ignore = 0;
+    char bin_path[MAXLINE];
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -1016,6 +1440,15 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* Read the trace file header */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
+    trace->map_len = 0;
+
+    /* Map the trace if it is binary, or if it has an up-to-date binary form */
+    if (map_trace(trace, stats, trace->filename, false))
+        return trace;
+    bin_trace_name(trace->filename, bin_path);
+    if (!unbatch && map_trace(trace, stats, bin_path, true))
+        return trace;
+
     if ((tracefile = fopen(trace->filename, "r")) == NULL)
     {
         unix_error("Could not open %s in read_trace", trace->filename);
@@ -1055,8 +1488,13 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    num_lines = trace->num_ops;
+    stats->ops = 0;
     while (fscanf(tracefile, "%s", type) != EOF)
     {
+        count = 1;
+        size = 0;
+        align = ALIGNMENT;
         switch (type[0])
         {
         case 'a':
@@ -1064,6 +1502,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = ALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
+            trace->block_sizes[index] = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'r':
@@ -1071,33 +1510,230 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = REALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
+            trace->block_sizes[index] = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'f':
             ignore += fscanf(tracefile, "%u", &index);
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
+            /* The size of the block, for mm_free_sized */
+            trace->ops[op_index].size =
+                (index >= 0) ? trace->block_sizes[index] : 0;
+            break;
+        case 'A':
+            ignore += fscanf(tracefile, "%u %u %lu", &index, &count, &size);
+            trace->ops[op_index].type = ALLOC_BATCH;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            break;
+        case 'F':
+            ignore += fscanf(tracefile, "%u %u", &index, &count);
+            trace->ops[op_index].type = FREE_BATCH;
+            trace->ops[op_index].index = index;
+            break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->block_sizes[index] = size;
+            max_index = (index > max_index) ? index : max_index;
             break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
         }
-        op_index++;
-        if (op_index == trace->num_ops)
+        trace->ops[op_index].count = count;
+        trace->ops[op_index].align = align;
+
+        if (count != 1)
+        {
+            if (count < 1 || index + count > trace->num_ids)
+                app_error("Bad batch of %d ids from %d in tracefile %s\n",
+                          count, index, trace->filename);
+            max_index = (index + count - 1 > max_index) ? index + count - 1
+                                                        : max_index;
+        }
+        stats->ops += count;
+        if (type[0] == 'A')
+            for (int j = 0; j < count; j++)
+                trace->block_sizes[index + j] = size;
+
+        /* Replay the batch as count single requests */
+        if (unbatch && (type[0] == 'A' || type[0] == 'F'))
+        {
+            trace->num_ops += count - 1;
+            if ((trace->ops = (traceop_t *)realloc(
+                     trace->ops, trace->num_ops * sizeof(traceop_t))) == NULL)
+                unix_error("realloc failed in read_trace");
+            for (int j = 0; j < count; j++)
+            {
+                trace->ops[op_index].type = (type[0] == 'A') ? ALLOC : FREE;
+                trace->ops[op_index].index = index + j;
+                trace->ops[op_index].size = trace->block_sizes[index + j];
+                trace->ops[op_index].count = 1;
+                trace->ops[op_index].align = ALIGNMENT;
+                op_index++;
+            }
+        }
+        else
+        {
+            op_index++;
+        }
+        if (--num_lines == 0)
             break;
     }
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+    memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
 
     return trace;
 }
 
+/*
+ * map_trace - Map the requests of a binary trace written by write_bin_trace,
+ *     and set up the rest of the trace record as read_trace does. The
+ *     binary form (twin) of a text trace is used only if it is not older
+ *     than the text and was written by a build with the same traceop_t.
+ *     Returns false if the trace is to be read as text instead.
+ */
+static bool map_trace(trace_t *trace, stats_t *stats, const char *path,
+                      bool twin)
+{
+    bin_header_t header;
+    struct stat st, text_st;
+    void *map;
+    int fd, i;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return false;
+    if (fstat(fd, &st) < 0 ||
+        read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, BIN_MAGIC, sizeof(header.magic)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    const char *problem = NULL;
+    if (header.byte_order != BIN_BYTE_ORDER ||
+        header.op_size != sizeof(traceop_t))
+        problem = "was written by another build";
+    else if (header.num_ops < 0 || header.num_ids < 0 ||
+             (size_t)st.st_size !=
+                 sizeof(header) + header.num_ops * sizeof(traceop_t))
+        problem = "is truncated";
+    else if (twin && (stat(trace->filename, &text_st) < 0 ||
+                      st.st_mtime < text_st.st_mtime))
+        problem = "is older than the text trace";
+    else if (!twin && unbatch)
+        problem = "cannot be replayed with -B";
+    if (problem != NULL)
+    {
+        close(fd);
+        if (!twin)
+            app_error("%s %s\n", path, problem);
+        if (verbose > 1)
+            printf("Not using %s: it %s\n", path, problem);
+        return false;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        unix_error("mmap failed in map_trace");
+    if (verbose > 1)
+        printf("Mapped binary trace: %s\n", path);
+
+    trace->weight = header.weight;
+    trace->num_ids = header.num_ids;
+    trace->num_ops = header.num_ops;
+    trace->data_bytes = header.data_bytes;
+    trace->ops = (traceop_t *)((char *)map + sizeof(header));
+    trace->map_len = st.st_size;
+    if (trace->weight > 3)
+        app_error("%s: weight can only be in {0, 1, 2 3}", path);
+
+    /* The requests are used as they are, but must not make replay_op
+       index past the blocks */
+    stats->ops = 0;
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+        if (op->type > MEMALIGN || op->count < 1 ||
+            (op->index < 0 && (op->type != FREE || op->count != 1)) ||
+            op->index > trace->num_ids - op->count)
+            app_error("Bad request %d in binary trace %s\n", i, path);
+        stats->ops += op->count;
+    }
+
+    if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
+            NULL ||
+        (trace->block_sizes =
+             (size_t *)calloc(trace->num_ids, sizeof(size_t))) == NULL ||
+        (trace->block_rand_base =
+             calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("calloc failed in map_trace");
+
+    strcpy(stats->filename, trace->filename);
+    stats->weight = trace->weight;
+    return true;
+}
+
+/*
+ * bin_trace_name - Name the binary form of a text trace: its .rep suffix
+ *     replaced by .bin, or .bin appended
+ */
+static void bin_trace_name(const char *path, char *buf)
+{
+    size_t len = strlen(path);
+
+    if (len >= 4 && strcmp(path + len - 4, ".rep") == 0)
+        len -= 4;
+    if (len + 5 > MAXLINE)
+        app_error("Trace name %s is too long\n", path);
+    memcpy(buf, path, len);
+    strcpy(buf + len, ".bin");
+}
+
+/*
+ * write_bin_trace - Write a trace in the binary form read by map_trace. It
+ *     goes to a temporary file first, so that a run reading the trace at
+ *     the same time never maps half of it.
+ */
+static void write_bin_trace(const trace_t *trace, const char *path)
+{
+    bin_header_t header;
+    char tmp[MAXLINE + 8];
+    FILE *file;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BIN_MAGIC, sizeof(header.magic));
+    header.byte_order = BIN_BYTE_ORDER;
+    header.op_size = sizeof(traceop_t);
+    header.weight = trace->weight;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.data_bytes = trace->data_bytes;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((file = fopen(tmp, "wb")) == NULL)
+        unix_error("Could not open %s in write_bin_trace", tmp);
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, file) !=
+            (size_t)trace->num_ops ||
+        fclose(file) != 0)
+        unix_error("Could not write %s in write_bin_trace", tmp);
+    if (rename(tmp, path) != 0)
+        unix_error("Could not rename %s in write_bin_trace", tmp);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -1110,11 +1746,14 @@ static void reinit_trace(trace_t *trace)
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or mapped) in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map_len != 0) /* unmap the header along with the requests */
+        munmap((char *)trace->ops - sizeof(bin_header_t), trace->map_len);
+    else
+        free(trace->ops); /* free the three arrays... */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
@@ -1131,15 +1770,15 @@ static void free_trace(trace_t *trace)
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
-    int index;
-    size_t size;
+    int i, j;
+    int index, count;
+    size_t size, align;
     char *newp;
     char *oldp;
     char *p;
     bool allCheck = true;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range set */
     mem_reset_brk();
     reinit_trace(trace);
 
@@ -1158,7 +1797,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
         if (debug_mode == DBG_EXPENSIVE)
         {
-            range_t *r;
+            int k, r;
 
             /* Let the students check their own heap */
             if (!mm_checkheap(0))
@@ -1168,14 +1807,16 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             };
 
             /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r)
+            for (k = 0; k < ranges->num_runs; k++)
             {
-                if (!check_index(trace, i, r->index))
+                for (r = 0; r < ranges->runs[k]->count; r++)
                 {
-                    allCheck = false;
+                    long id = ranges->runs[k]->ranges[r].index;
+                    if (!check_index(trace, i, id))
+                    {
+                        allCheck = false;
+                    }
                 }
-                r = r->next;
             }
         }
 
@@ -1193,10 +1834,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range set if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
+            if (add_range(ranges, p, size, ALIGNMENT, trace, i, index) == 0)
                 return false;
 
             /* Remember region */
@@ -1207,6 +1848,24 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             randomize_block(trace, index);
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            align = trace->ops[i].align;
+
+            /* Call the student's memalign */
+            if ((p = mm_memalign(align, size)) == NULL)
+            {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+
+            /* Check the block as for mm_malloc, with its own alignment */
+            if (add_range(ranges, p, size, align, trace, i, index) == 0)
+                return false;
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
         case REALLOC: /* mm_realloc */
             if (!check_index(trace, i, index))
             {
@@ -1231,13 +1890,13 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 return false;
             }
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range set */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range set */
             if (size > 0)
             {
-                if (add_range(ranges, newp, size, trace, i, index) == 0)
+                if (add_range(ranges, newp, size, ALIGNMENT, trace, i, index) == 0)
                     return false;
             }
 
@@ -1277,7 +1936,45 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            if (sized_free)
+                mm_free_sized(p, trace->ops[i].size);
+            else
+                mm_free(p);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            count = trace->ops[i].count;
+
+            /* Call the student's batch malloc */
+            if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+                (size_t)count)
+            {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+
+            /* Check and remember every block, as for mm_malloc */
+            for (j = index; j < index + count; j++)
+            {
+                p = trace->blocks[j];
+                if (add_range(ranges, p, size, ALIGNMENT, trace, i, j) == 0)
+                    return false;
+                trace->block_sizes[j] = size;
+                randomize_block(trace, j);
+            }
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            count = trace->ops[i].count;
+            for (j = index; j < index + count; j++)
+            {
+                if (!check_index(trace, i, j))
+                {
+                    allCheck = false;
+                }
+                remove_range(ranges, trace->blocks[j]);
+            }
+            mm_free_batch((void **)&trace->blocks[index], count);
             break;
 
         default:
@@ -1294,19 +1991,27 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace. Since regions mapped with mem_map come and
+ *   go, and the heap may be trimmed with a negative mem_sbrk, heapsize
+ *   is the peak footprint, i.e., the largest sum of the brk extent and
+ *   the mapped bytes seen during the trace. Giving memory back early
+ *   lowers that peak when another phase of the trace needs it again.
+ *
+ *   The footprint, the number of heap extensions, and the tail waste
+ *   (the bytes between the end of the highest payload and the break,
+ *   while the heap is at its largest) are recorded in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    size_t heap_peak = 0;
+    char *heap_top = NULL;
     char *p;
     char *newp, *oldp;
 
@@ -1339,14 +2044,31 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size += size;
             break;
 
-        case REALLOC: /* mm_realloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldsize = trace->block_sizes[index];
+            size = trace->ops[i].size;
 
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+            {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember region and size */
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            index = trace->ops[i].index;
+            newsize = trace->ops[i].size;
+            oldsize = trace->block_sizes[index];
+
+            oldp = trace->blocks[index];
+            setUBCheck(false);
+            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
             {
                 app_error("trace %d: mm_realloc failed in eval_mm_util",
                           tracenum);
@@ -1373,11 +2095,43 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            if (sized_free)
+                mm_free_sized(p, trace->ops[i].size);
+            else
+                mm_free(p);
 
             total_size -= size;
             break;
 
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            count = trace->ops[i].count;
+
+            if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+                (size_t)count)
+            {
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            }
+
+            /* Remember the sizes */
+            for (j = index; j < index + count; j++)
+                trace->block_sizes[j] = size;
+
+            total_size += size * count;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+
+            mm_free_batch((void **)&trace->blocks[index], count);
+
+            for (j = index; j < index + count; j++)
+                total_size -= trace->block_sizes[j];
+            break;
+
         default:
             app_error("trace %d: Nonexistent request type in eval_mm_util",
                       tracenum);
@@ -1386,13 +2140,40 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size =
             (total_size > max_total_size) ? total_size : max_total_size;
+
+        /* track the highest payload end while the heap is at its peak */
+        size_t heapsize = mem_heapsize();
+        if (heapsize > heap_peak)
+        {
+            heap_peak = heapsize;
+            heap_top = NULL;
+        }
+        if (trace->ops[i].type != FREE && trace->ops[i].type != FREE_BATCH &&
+            heapsize == heap_peak)
+        {
+            index = trace->ops[i].index;
+            for (j = index; j < index + trace->ops[i].count; j++)
+            {
+                p = trace->blocks[j];
+                char *end = p + trace->block_sizes[j];
+                if (p >= (char *)mem_heap_lo() &&
+                    end <= (char *)mem_heap_hi() + 1 && end > heap_top)
+                    heap_top = end;
+            }
+        }
     }
 
+    stats->peak_bytes = mem_peak_footprint();
+    stats->end_bytes = mem_heapsize() + mem_mapsize();
+    stats->extends = mem_extend_count();
+    stats->tail_waste =
+        heap_top ? (size_t)((char *)mem_heap_lo() + heap_peak - heap_top) : 0;
+
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 /*
@@ -1401,10 +2182,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
+    int i;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    latency_t *latency = ((speed_t *)ptr)->latency;
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
@@ -1413,45 +2193,105 @@ static void eval_mm_speed(void *ptr)
         app_error("mm_init failed in eval_mm_speed");
 
     /* Interpret each trace request */
+    if (latency == NULL)
+    {
+        for (i = 0; i < trace->num_ops; i++)
+            replay_op(trace, i);
+        return;
+    }
+
+    /* ... timing each one */
+    struct timespec start, end;
+    uint64_t first, last;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    first = last = lat_ticks();
     for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type)
-        {
+    {
+        replay_op(trace, i);
+        uint64_t now = lat_ticks();
+        lat_record(latency, trace->ops[i].type, now - last);
+        last = lat_ticks();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    latency->ticks += last - first;
+    latency->ns += (end.tv_sec - start.tv_sec) * 1e9 +
+                   (end.tv_nsec - start.tv_nsec);
+}
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+/*
+ * replay_op - Issue request i of the trace to the mm malloc package,
+ *    without any checking
+ */
+static void replay_op(trace_t *trace, int i)
+{
+    int index, count;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
-            trace->blocks[index] = newp;
-            break;
+    switch (trace->ops[i].type)
+    {
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index < 0)
-            {
-                block = 0;
-            }
-            else
-            {
-                block = trace->blocks[index];
-            }
-            mm_free(block);
-            break;
+    case ALLOC: /* mm_malloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = mm_malloc(size)) == NULL)
+            app_error("mm_malloc error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
 
-        default:
-            app_error("Nonexistent request type in eval_mm_speed");
+    case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+            app_error("mm_memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        break;
+
+    case REALLOC: /* mm_realloc */
+        index = trace->ops[i].index;
+        newsize = trace->ops[i].size;
+        oldp = trace->blocks[index];
+        setUBCheck(false);
+        if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+            app_error("mm_realloc error in eval_mm_speed");
+        setUBCheck(true);
+        trace->blocks[index] = newp;
+        break;
+
+    case FREE: /* mm_free */
+        index = trace->ops[i].index;
+        if (index < 0)
+        {
+            block = 0;
+        }
+        else
+        {
+            block = trace->blocks[index];
         }
+        if (sized_free)
+            mm_free_sized(block, trace->ops[i].size);
+        else
+            mm_free(block);
+        break;
+
+    case ALLOC_BATCH: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        count = trace->ops[i].count;
+        if (mm_malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+            (size_t)count)
+            app_error("mm_malloc_batch error in eval_mm_speed");
+        break;
+
+    case FREE_BATCH: /* mm_free_batch */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+        mm_free_batch((void **)&trace->blocks[index], count);
+        break;
+
+    default:
+        app_error("Nonexistent request type in eval_mm_speed");
+    }
 }
 
 /*
@@ -1462,7 +2302,7 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
-    int i;
+    int i, j;
     size_t newsize;
     char *p, *newp, *oldp;
 
@@ -1482,6 +2322,16 @@ static bool eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            if (posix_memalign((void **)&p, trace->ops[i].align,
+                               trace->ops[i].size) != 0)
+            {
+                malloc_error(trace, i, "libc posix_memalign failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1504,6 +2354,23 @@ static bool eval_libc_valid(trace_t *trace)
             }
             break;
 
+        case ALLOC_BATCH: /* one malloc per block */
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                if ((p = malloc(trace->ops[i].size)) == NULL)
+                {
+                    malloc_error(trace, i, "libc malloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index + j] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* one free per block */
+            for (j = 0; j < trace->ops[i].count; j++)
+                free(trace->blocks[trace->ops[i].index + j]);
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1519,7 +2386,7 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1539,6 +2406,14 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+                unix_error("posix_memalign failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1561,6 +2436,23 @@ static void eval_libc_speed(void *ptr)
                 free(0);
             }
             break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            for (j = index; j < index + trace->ops[i].count; j++)
+            {
+                if ((p = malloc(size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[j] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* one free per block */
+            index = trace->ops[i].index;
+            for (j = index; j < index + trace->ops[i].count; j++)
+                free(trace->blocks[j]);
+            break;
         }
     }
 }
@@ -1994,6 +2886,850 @@ static double measure_ref_throughput(bool checkpoint)
     return (double)t;
 }
 
+/*
+ * print_mm_stats - Print the allocator statistics left by the last
+ *     replay of a trace, one line per size class that saw any activity
+ */
+static void print_mm_stats(const char *filename)
+{
+    mm_stats_t st;
+    int c;
+
+    if (!mm_get_stats(&st))
+    {
+        fprintf(stderr, "Warning: mm.c keeps no statistics, build it with "
+                        "\"make STATS=1\"\n");
+        return;
+    }
+
+    printf("Allocator statistics for %s:\n", filename);
+    printf("  heap %zu bytes, mapped %zu bytes, in use %zu bytes at the "
+           "peak and %zu at the end\n",
+           st.heap_size, st.mapped_size, st.peak_in_use, st.bytes_in_use);
+    printf("  %zu heap extensions, %zu trims\n", st.extends, st.trims);
+    printf("  %5s %10s %10s %10s %10s %10s %10s\n", "class", "allocs",
+           "frees", "splits", "coalesces", "fits", "probes/fit");
+    for (c = 0; c < MM_STATS_CLASSES; c++)
+    {
+        mm_class_stats_t *cs = &st.classes[c];
+        if (cs->allocs + cs->frees + cs->splits + cs->coalesces +
+                cs->fit_calls ==
+            0)
+            continue;
+        printf("  %5d %10zu %10zu %10zu %10zu %10zu %10.1f\n", c, cs->allocs,
+               cs->frees, cs->splits, cs->coalesces, cs->fit_calls,
+               cs->fit_calls ? (double)cs->fit_probes / cs->fit_calls : 0.0);
+    }
+}
+
+/*
+ * dump_mm_profile - Write the allocation samples of the last profiled
+ *     replay of a trace to <trace basename>.prof in the current directory
+ */
+static void dump_mm_profile(const char *filename)
+{
+    char path[MAXLINE];
+    const char *base = strrchr(filename, '/');
+
+    base = (base == NULL) ? filename : base + 1;
+    snprintf(path, sizeof(path), "%s.prof", base);
+    if (!mm_profile_dump(path))
+    {
+        fprintf(stderr, "Warning: could not write profile %s\n", path);
+        return;
+    }
+    if (verbose)
+        printf("Profile of %s written to %s\n", filename, path);
+}
+
+/*****************************************************************
+ * Subsets of a trace, for the reducer and the threaded replay
+ ****************************************************************/
+
+/*
+ * subset_trace - Make a trace of the included requests of a trace. The ids
+ *     left are renumbered in order, so that batches stay contiguous, and
+ *     the sizes recorded by frees and the peak data bytes are recomputed
+ */
+static trace_t *subset_trace(const trace_t *trace, const bool *include)
+{
+    trace_t *small;
+    int *ids;
+    size_t *sizes;
+    size_t live = 0;
+    int i, j, index, count;
+
+    if ((small = (trace_t *)malloc(sizeof(trace_t))) == NULL ||
+        (ids = (int *)malloc(trace->num_ids * sizeof(int))) == NULL ||
+        (small->ops = (traceop_t *)malloc(trace->num_ops *
+                                          sizeof(traceop_t))) == NULL)
+        unix_error("malloc failed in subset_trace");
+    strcpy(small->filename, trace->filename);
+    small->weight = trace->weight;
+    small->map_len = 0;
+
+    for (j = 0; j < trace->num_ids; j++)
+        ids[j] = -1;
+    for (i = 0; i < trace->num_ops; i++)
+        if (include[i])
+            for (j = 0; j < trace->ops[i].count; j++)
+                if (trace->ops[i].index >= 0)
+                    ids[trace->ops[i].index + j] = 0;
+    small->num_ids = 0;
+    for (j = 0; j < trace->num_ids; j++)
+        if (ids[j] == 0)
+            ids[j] = small->num_ids++;
+
+    if ((small->blocks = calloc(small->num_ids, sizeof(char *))) == NULL ||
+        (small->block_sizes = calloc(small->num_ids, sizeof(size_t))) ==
+            NULL ||
+        (small->block_rand_base =
+             calloc(small->num_ids, sizeof(*small->block_rand_base))) ==
+            NULL ||
+        (sizes = calloc(small->num_ids, sizeof(size_t))) == NULL)
+        unix_error("calloc failed in subset_trace");
+
+    small->num_ops = 0;
+    small->data_bytes = 0;
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        if (!include[i])
+            continue;
+        traceop_t *op = &small->ops[small->num_ops++];
+        *op = trace->ops[i];
+        if (op->index < 0)
+            continue;
+        op->index = index = ids[op->index];
+        count = op->count;
+        for (j = index; j < index + count; j++)
+        {
+            live -= sizes[j];
+            if (op->type == FREE || op->type == FREE_BATCH)
+            {
+                op->size = (op->type == FREE) ? sizes[j] : op->size;
+                sizes[j] = 0;
+            }
+            else
+                sizes[j] = op->size;
+            live += sizes[j];
+        }
+        if (live > small->data_bytes)
+            small->data_bytes = live;
+    }
+    free(ids);
+    free(sizes);
+    return small;
+}
+
+/*
+ * batch_root - Find the first id of the batch an id belongs to
+ */
+static int batch_root(int *root, int id)
+{
+    while (root[id] != id)
+    {
+        root[id] = root[root[id]];
+        id = root[id];
+    }
+    return id;
+}
+
+/*
+ * batch_roots - Make the table used by batch_root, in which the ids freed
+ *     or allocated by one batch request have the same root
+ */
+static int *batch_roots(const trace_t *trace)
+{
+    int *root;
+    int i, j;
+
+    if ((root = (int *)malloc(trace->num_ids * sizeof(int))) == NULL)
+        unix_error("malloc failed in batch_roots");
+    for (j = 0; j < trace->num_ids; j++)
+        root[j] = j;
+    for (i = 0; i < trace->num_ops; i++)
+        for (j = 1; j < trace->ops[i].count; j++)
+            root[batch_root(root, trace->ops[i].index + j)] =
+                batch_root(root, trace->ops[i].index);
+    return root;
+}
+
+/*****************************************************************
+ * Trace reduction (-R): delta debugging over the requests of one trace.
+ * A pass splits a list of units in chunks and keeps the first candidate
+ * that is still interesting, either one chunk alone or all but one chunk,
+ * refining the chunks when none is. The first pass removes whole blocks
+ * (every request on an id, the ids of a batch together), the second the
+ * reallocs and frees that are left, until neither removes anything.
+ *
+ * A candidate is interesting if its replay fails (a check of the driver,
+ * mm_checkheap with -D or in mdriver-dbg, or a crash) or, with -X, if one
+ * of its requests takes at least slow_ns ns. Candidates are replayed in
+ * child processes, reduce_jobs at a time, with their output discarded.
+ ****************************************************************/
+
+/* Timed replays of a candidate, each request counts with its fastest time */
+#define REDUCE_REPS 3
+
+typedef struct
+{
+    trace_t *trace; /* the trace as read */
+    bool *keep;     /* the requests kept so far */
+    int *unit;      /* unit of each request in this pass, -1 if always kept */
+    int *pos;       /* position of each unit in the list of the pass */
+    int num_kept;   /* number of requests kept */
+} reduce_t;
+
+/*
+ * slowest_op - Replay a trace REDUCE_REPS times, timing every request, and
+ *     return the time in ns of the slowest request, a request taking the
+ *     least time it took in any replay so that one interrupt does not count
+ */
+static long slowest_op(trace_t *trace, int *opnum)
+{
+    struct timespec start, end;
+    long *best;
+    long worst = 0;
+    int rep, i;
+
+    if ((best = (long *)malloc(trace->num_ops * sizeof(long))) == NULL)
+        unix_error("malloc failed in slowest_op");
+    for (rep = 0; rep < REDUCE_REPS; rep++)
+    {
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in slowest_op\n");
+        for (i = 0; i < trace->num_ops; i++)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            replay_op(trace, i);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            long ns = (end.tv_sec - start.tv_sec) * 1000000000L +
+                      (end.tv_nsec - start.tv_nsec);
+            if (rep == 0 || ns < best[i])
+                best[i] = ns;
+        }
+    }
+    *opnum = 0;
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        if (best[i] > worst)
+        {
+            worst = best[i];
+            *opnum = i;
+        }
+    }
+    free(best);
+    return worst;
+}
+
+/*
+ * reduce_spawn - Replay the included requests of a trace in a child
+ *     process, which exits with 0 if they are interesting
+ */
+static pid_t reduce_spawn(const trace_t *trace, const bool *include)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        unix_error("fork failed in reduce_spawn");
+    if (pid > 0)
+        return pid;
+
+    if (freopen("/dev/null", "w", stdout) == NULL ||
+        freopen("/dev/null", "w", stderr) == NULL)
+        _exit(1);
+    if (set_timeout > 0)
+    {
+        signal(SIGALRM, SIG_DFL);
+        alarm(set_timeout);
+    }
+    trace_t *small = subset_trace(trace, include);
+    mem_init(sparse_mode);
+    range_set_t *ranges = new_range_set();
+    bool valid = eval_mm_valid(small, ranges);
+    if (slow_ns == 0)
+        _exit(valid ? 1 : 0);
+    int opnum;
+    _exit(valid && slowest_op(small, &opnum) >= slow_ns ? 0 : 1);
+}
+
+/*
+ * reduce_wait - Wait for a child of reduce_spawn, return true if its
+ *     candidate was interesting. Without -X, a crash is a failure too
+ */
+static bool reduce_wait(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0)
+        unix_error("waitpid failed in reduce_wait");
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status) == 0;
+    return slow_ns == 0 && WIFSIGNALED(status);
+}
+
+/*
+ * reduce_include - Mark the requests of candidate c of a pass over len
+ *     units in chunks: the kept requests whose unit is in chunk c, or for
+ *     c >= chunks, in any chunk but c - chunks
+ */
+static void reduce_include(const reduce_t *r, int len, int chunks, int c,
+                           bool *include)
+{
+    int lo = (long)(c % chunks) * len / chunks;
+    int hi = (long)(c % chunks + 1) * len / chunks;
+    int i;
+
+    for (i = 0; i < r->trace->num_ops; i++)
+    {
+        int u = r->unit[i];
+        include[i] = r->keep[i] &&
+                     (u < 0 || ((lo <= r->pos[u] && r->pos[u] < hi) !=
+                                (c >= chunks)));
+    }
+}
+
+/*
+ * reduce_first - Replay the candidates of a pass over len units in chunks,
+ *     and return the first interesting one, -1 if there is none
+ */
+static int reduce_first(const reduce_t *r, int len, int chunks,
+                        bool *include)
+{
+    /* With two chunks, removing one is keeping the other */
+    int num_cands = (chunks == 2) ? 2 : 2 * chunks;
+    pid_t *pids;
+    int c, k;
+
+    if ((pids = (pid_t *)malloc(num_cands * sizeof(pid_t))) == NULL)
+        unix_error("malloc failed in reduce_first");
+    for (k = 0; k < num_cands; k += reduce_jobs)
+    {
+        int end = (k + reduce_jobs < num_cands) ? k + reduce_jobs : num_cands;
+        int found = -1;
+        for (c = k; c < end; c++)
+        {
+            reduce_include(r, len, chunks, c, include);
+            pids[c] = reduce_spawn(r->trace, include);
+        }
+        for (c = k; c < end; c++)
+            if (reduce_wait(pids[c]) && found < 0)
+                found = c;
+        if (found >= 0)
+        {
+            free(pids);
+            return found;
+        }
+    }
+    free(pids);
+    return -1;
+}
+
+/*
+ * reduce_pass - Remove as many units of the kept requests as ddmin can,
+ *     given the unit of every request in r->unit, below num_units
+ */
+static void reduce_pass(reduce_t *r, int num_units)
+{
+    int *list;
+    bool *include;
+    int len = 0, chunks = 2;
+    int i, p;
+
+    if ((list = (int *)malloc(num_units * sizeof(int))) == NULL ||
+        (include = (bool *)malloc(r->trace->num_ops * sizeof(bool))) == NULL)
+        unix_error("malloc failed in reduce_pass");
+    for (i = 0; i < num_units; i++)
+        r->pos[i] = -1;
+    for (i = 0; i < r->trace->num_ops; i++)
+    {
+        int u = r->unit[i];
+        if (r->keep[i] && u >= 0 && r->pos[u] < 0)
+        {
+            r->pos[u] = len;
+            list[len++] = u;
+        }
+    }
+
+    while (len >= 2)
+    {
+        if (chunks > len)
+            chunks = len;
+        int c = reduce_first(r, len, chunks, include);
+        if (c < 0)
+        {
+            if (chunks == len)
+                break;
+            chunks = (2 * chunks < len) ? 2 * chunks : len;
+            continue;
+        }
+
+        /* Keep the candidate, and drop its removed units from the list */
+        int lo = (long)(c % chunks) * len / chunks;
+        int hi = (long)(c % chunks + 1) * len / chunks;
+        reduce_include(r, len, chunks, c, r->keep);
+        r->num_kept = 0;
+        for (i = 0; i < r->trace->num_ops; i++)
+            r->num_kept += r->keep[i];
+        int n = 0;
+        for (p = 0; p < len; p++)
+        {
+            if ((lo <= p && p < hi) != (c >= chunks))
+            {
+                list[n] = list[p];
+                r->pos[list[n]] = n;
+                n++;
+            }
+        }
+        len = n;
+        chunks = (c >= chunks && chunks > 2) ? chunks - 1 : 2;
+        if (verbose)
+            printf("Reduced to %d requests\n", r->num_kept);
+    }
+    free(list);
+    free(include);
+}
+
+/*
+ * reduce_trace - Shrink a trace while it fails (or, with -X, while one of
+ *     its requests stays slow), and write the result to reduce_file
+ */
+static void reduce_trace(const char *tracedir, const char *filename)
+{
+    stats_t stats;
+    reduce_t r;
+    int *root;
+    int i, before;
+
+    trace_t *trace = read_trace(&stats, tracedir, filename);
+    int num_ops = trace->num_ops;
+    int num_units = (trace->num_ids > num_ops) ? trace->num_ids : num_ops;
+    r.trace = trace;
+    r.num_kept = num_ops;
+    if ((r.keep = (bool *)malloc(num_ops * sizeof(bool))) == NULL ||
+        (r.unit = (int *)malloc(num_ops * sizeof(int))) == NULL ||
+        (r.pos = (int *)malloc(num_units * sizeof(int))) == NULL)
+        unix_error("malloc failed in reduce_trace");
+    for (i = 0; i < num_ops; i++)
+        r.keep[i] = true;
+    if (reduce_jobs <= 0)
+        reduce_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reduce_jobs <= 0)
+        reduce_jobs = 1;
+
+    if (!reduce_wait(reduce_spawn(trace, r.keep)))
+        app_error("%s: the trace does not %s, nothing to reduce\n",
+                  trace->filename, slow_ns ? "have a slow request" : "fail");
+    if (verbose)
+        printf("Reducing %s: %d requests on %d ids, %ld candidates at a "
+               "time\n",
+               trace->filename, num_ops, trace->num_ids, reduce_jobs);
+
+    /* The ids of a batch are removed together */
+    root = batch_roots(trace);
+
+    do
+    {
+        before = r.num_kept;
+        for (i = 0; i < num_ops; i++)
+            r.unit[i] = (trace->ops[i].index >= 0)
+                            ? batch_root(root, trace->ops[i].index)
+                            : -1;
+        reduce_pass(&r, trace->num_ids);
+        for (i = 0; i < num_ops; i++)
+            r.unit[i] = (trace->ops[i].type == REALLOC ||
+                         trace->ops[i].type == FREE ||
+                         trace->ops[i].type == FREE_BATCH)
+                            ? i
+                            : -1;
+        reduce_pass(&r, num_ops);
+    } while (r.num_kept < before);
+
+    trace_t *small = subset_trace(trace, r.keep);
+    write_trace(small, reduce_file);
+    printf("Reduced %s from %d to %d requests on %d ids, written to %s\n",
+           trace->filename, num_ops, small->num_ops, small->num_ids,
+           reduce_file);
+    if (slow_ns > 0)
+    {
+        int opnum;
+        mem_init(sparse_mode);
+        long ns = slowest_op(small, &opnum);
+        printf("Slowest request: line %d, %ld ns\n", LINENUM(opnum), ns);
+    }
+    free_trace(small);
+    free_trace(trace);
+    free(r.keep);
+    free(r.unit);
+    free(r.pos);
+    free(root);
+}
+
+/*
+ * write_trace - Write a trace in the format read by read_trace
+ */
+static void write_trace(const trace_t *trace, const char *path)
+{
+    FILE *file;
+    int i;
+
+    if ((file = fopen(path, "w")) == NULL)
+        unix_error("Could not open %s in write_trace", path);
+    fprintf(file, "%d\n%d\n%d\n%zu\n", (int)trace->weight, trace->num_ids,
+            trace->num_ops, trace->data_bytes);
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+        switch (op->type)
+        {
+        case ALLOC:
+            fprintf(file, "a %ld %zu\n", op->index, op->size);
+            break;
+        case REALLOC:
+            fprintf(file, "r %ld %zu\n", op->index, op->size);
+            break;
+        case FREE:
+            fprintf(file, "f %ld\n", op->index);
+            break;
+        case ALLOC_BATCH:
+            fprintf(file, "A %ld %d %zu\n", op->index, op->count, op->size);
+            break;
+        case FREE_BATCH:
+            fprintf(file, "F %ld %d\n", op->index, op->count);
+            break;
+        case MEMALIGN:
+            fprintf(file, "m %ld %zu %zu\n", op->index, op->align, op->size);
+            break;
+        }
+    }
+    if (fclose(file) != 0)
+        unix_error("Could not write %s in write_trace", path);
+}
+
+/*****************************************************************
+ * Latency histograms (-L): after the throughput is measured, the trace
+ * is replayed LATENCY_REPS more times with each request timed, by the
+ * time stamp counter where there is one, and the times of each request
+ * type are put in a latency_t. The percentiles are read from its
+ * buckets, so they are at most 1/LAT_SUB above the exact ones.
+ ****************************************************************/
+
+#define LATENCY_REPS 3
+
+/*
+ * lat_ticks - Read the counter the requests are timed with
+ */
+static inline uint64_t lat_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/*
+ * lat_bucket - Find the bucket of a time: times below 2 * LAT_SUB have one
+ *     each, then each power of 2 is split into LAT_SUB buckets
+ */
+static inline int lat_bucket(uint64_t ticks)
+{
+    if (ticks < 2 * LAT_SUB)
+        return (int)ticks;
+    int shift = 63 - __builtin_clzll(ticks) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + (int)(ticks >> shift) - LAT_SUB;
+}
+
+/*
+ * lat_bucket_top - The largest time that goes in a bucket
+ */
+static uint64_t lat_bucket_top(int bucket)
+{
+    if (bucket < 2 * LAT_SUB)
+        return bucket;
+    int shift = bucket / LAT_SUB - 1;
+    uint64_t lo = (uint64_t)(bucket % LAT_SUB + LAT_SUB) << shift;
+    return lo + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * lat_record - Count a request of a type that took some ticks, less the
+ *     ticks of reading the counter
+ */
+static inline void lat_record(latency_t *latency, int type, uint64_t ticks)
+{
+    ticks = (ticks > latency->overhead) ? ticks - latency->overhead : 0;
+    latency->counts[type][lat_bucket(ticks)]++;
+    latency->sum[type] += ticks;
+    if (ticks > latency->max[type])
+        latency->max[type] = ticks;
+}
+
+/*
+ * lat_percentile - The time that a fraction of the requests of a type did
+ *     not exceed
+ */
+static uint64_t lat_percentile(const latency_t *latency, int type,
+                               uint64_t total, double fraction)
+{
+    uint64_t rank = (uint64_t)ceil(fraction * total), seen = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += latency->counts[type][b];
+        if (seen >= rank && seen > 0)
+            break;
+    }
+    /* The top of the last bucket may be above the slowest request */
+    uint64_t top = lat_bucket_top(b);
+    return (top < latency->max[type]) ? top : latency->max[type];
+}
+
+/*
+ * eval_mm_latency - Print the percentiles of the time taken by each type
+ *     of request of the trace, in ns
+ */
+static void eval_mm_latency(speed_t *speed_params)
+{
+    static const char *names[NUM_OP_TYPES] = {
+        [ALLOC] = "malloc",          [FREE] = "free",
+        [REALLOC] = "realloc",       [ALLOC_BATCH] = "malloc_batch",
+        [FREE_BATCH] = "free_batch", [MEMALIGN] = "memalign"};
+    latency_t *latency;
+    int i, type;
+
+    if ((latency = (latency_t *)calloc(1, sizeof(latency_t))) == NULL)
+        unix_error("calloc failed in eval_mm_latency");
+
+    /* The least it takes to read the counter twice is taken off each time */
+    latency->overhead = UINT64_MAX;
+    for (i = 0; i < 1000; i++)
+    {
+        uint64_t t = lat_ticks();
+        t = lat_ticks() - t;
+        latency->overhead = (t < latency->overhead) ? t : latency->overhead;
+    }
+
+    speed_params->latency = latency;
+    for (i = 0; i < LATENCY_REPS; i++)
+        eval_mm_speed(speed_params);
+    speed_params->latency = NULL;
+
+    double ns_per_tick = latency->ticks ? latency->ns / latency->ticks : 1;
+    printf("Latency of %s in ns (%d replays):\n",
+           speed_params->trace->filename, LATENCY_REPS);
+    printf("  %-12s %9s %8s %8s %8s %8s %10s\n", "request", "count", "mean",
+           "p50", "p99", "p99.9", "max");
+    for (type = 0; type < NUM_OP_TYPES; type++)
+    {
+        uint64_t total = 0;
+        for (i = 0; i < LAT_BUCKETS; i++)
+            total += latency->counts[type][i];
+        if (total == 0)
+            continue;
+        printf("  %-12s %9lu %8.0f %8.0f %8.0f %8.0f %10.0f\n", names[type],
+               (unsigned long)(total / LATENCY_REPS),
+               latency->sum[type] * ns_per_tick / total,
+               lat_percentile(latency, type, total, 0.5) * ns_per_tick,
+               lat_percentile(latency, type, total, 0.99) * ns_per_tick,
+               lat_percentile(latency, type, total, 0.999) * ns_per_tick,
+               latency->max[type] * ns_per_tick);
+    }
+    free(latency);
+}
+
+/*****************************************************************
+ * Threaded replay (-N): the requests of a trace are split among n
+ * threads, by id modulo n (the ids of a batch go together), or with -W
+ * every thread replays a whole copy of the trace. The threads replay
+ * against one heap, set up with MM_ARENA_MAX at n, for n from 1 up to
+ * max_threads by powers of 2, and the best of THREAD_REPS runs counts.
+ ****************************************************************/
+
+#define THREAD_REPS 3
+
+/* Largest ratio between the throughputs on one thread and of fsec that is
+   taken for noise */
+#define THREAD_TOLERANCE 1.25
+
+typedef struct
+{
+    trace_t *trace;            /* the requests of the thread */
+    double ops;                /* their number, a batch counting its blocks */
+    pthread_barrier_t *barrier; /* where the threads wait for each other */
+    struct timespec start;     /* when the thread started its requests... */
+    struct timespec end;       /* ... and ended them, in the last run */
+    double secs;               /* time the thread took in the last run */
+} replay_thread_t;
+
+/*
+ * replay_thread - Replay the requests of one thread, once every thread
+ *     is ready
+ */
+static void *replay_thread(void *arg)
+{
+    replay_thread_t *rt = (replay_thread_t *)arg;
+    int i;
+
+    pthread_barrier_wait(rt->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &rt->start);
+    for (i = 0; i < rt->trace->num_ops; i++)
+        replay_op(rt->trace, i);
+    clock_gettime(CLOCK_MONOTONIC, &rt->end);
+    rt->secs = (rt->end.tv_sec - rt->start.tv_sec) +
+               (rt->end.tv_nsec - rt->start.tv_nsec) / 1e9;
+    return NULL;
+}
+
+/*
+ * replay_threads - Run the threads once on a fresh heap, return the time
+ *     from the start of the first to the end of the last
+ */
+static double replay_threads(replay_thread_t *threads, int n)
+{
+    pthread_t tids[n];
+    pthread_barrier_t barrier;
+    int k;
+
+    mem_reset_brk();
+    if (!mm_mallopt(MM_ARENA_MAX, n))
+        app_error("mm_mallopt: %d arenas not supported\n", n);
+    if (!mm_init())
+        app_error("mm_init failed in replay_threads\n");
+
+    pthread_barrier_init(&barrier, NULL, n);
+    for (k = 0; k < n; k++)
+    {
+        reinit_trace(threads[k].trace);
+        threads[k].barrier = &barrier;
+        if (pthread_create(&tids[k], NULL, replay_thread, &threads[k]) != 0)
+            app_error("pthread_create failed in replay_threads\n");
+    }
+    for (k = 0; k < n; k++)
+        pthread_join(tids[k], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    if (!mm_checkheap(__LINE__))
+        app_error("mm_checkheap failed after a replay on %d threads\n", n);
+
+    /* The threads' own clocks, not this thread's: it may be scheduled
+       only after they are done */
+    time_t base = threads[0].start.tv_sec;
+    double start = 0, end = 0;
+    for (k = 0; k < n; k++)
+    {
+        double s = (threads[k].start.tv_sec - base) +
+                   threads[k].start.tv_nsec / 1e9;
+        double e = (threads[k].end.tv_sec - base) +
+                   threads[k].end.tv_nsec / 1e9;
+        start = (k == 0 || s < start) ? s : start;
+        end = (k == 0 || e > end) ? e : end;
+    }
+    return end - start;
+}
+
+/*
+ * eval_mm_threads - Print the throughput of the trace on 1 up to
+ *     max_threads threads, and the mean latency of a request in each thread.
+ *     The throughput on one thread is checked against single_tput, the
+ *     one measured by fsec.
+ */
+static void eval_mm_threads(trace_t *trace, double single_tput)
+{
+    replay_thread_t threads[max_threads];
+    double best_secs[max_threads];
+    bool *include;
+    int *root = batch_roots(trace);
+    double base_tput = 0;
+    size_t one_peak = 0;
+    int n, k, i, rep;
+
+    if ((include = (bool *)malloc(trace->num_ops * sizeof(bool))) == NULL)
+        unix_error("malloc failed in eval_mm_threads");
+
+    printf("Threaded replay of %s (%s):\n", trace->filename,
+           whole_traces ? "a whole copy per thread" : "ids split by thread");
+    printf("%8s %10s %8s   %s\n", "threads", "Kops/sec", "speedup",
+           "ns/request per thread (min avg max)");
+    for (n = 1;; n = (2 * n < max_threads) ? 2 * n : max_threads)
+    {
+        /* n whole copies share the emulated heap, stop before it runs out */
+        if (whole_traces && n * one_peak > MAX_DENSE_HEAP)
+        {
+            printf("%8d   (%d copies would need about %zu MB of heap)\n", n,
+                   n, n * one_peak >> 20);
+            break;
+        }
+        for (k = 0; k < n; k++)
+        {
+            for (i = 0; i < trace->num_ops; i++)
+            {
+                int index = trace->ops[i].index;
+                include[i] = whole_traces ||
+                             (index >= 0 ? batch_root(root, index) : i) % n ==
+                                 k;
+            }
+            threads[k].trace = subset_trace(trace, include);
+            threads[k].ops = 0;
+            for (i = 0; i < threads[k].trace->num_ops; i++)
+                threads[k].ops += threads[k].trace->ops[i].count;
+        }
+
+        /* Keep the fastest run, with the times of its threads */
+        double secs = 0, ops = 0;
+        for (rep = 0; rep < THREAD_REPS; rep++)
+        {
+            double s = replay_threads(threads, n);
+            if (rep == 0 || s < secs)
+            {
+                secs = s;
+                for (k = 0; k < n; k++)
+                    best_secs[k] = threads[k].secs;
+            }
+        }
+
+        double lat_min = 0, lat_max = 0, lat_sum = 0;
+        for (k = 0; k < n; k++)
+        {
+            double lat = threads[k].ops ? best_secs[k] * 1e9 / threads[k].ops
+                                        : 0;
+            lat_min = (k == 0 || lat < lat_min) ? lat : lat_min;
+            lat_max = (k == 0 || lat > lat_max) ? lat : lat_max;
+            lat_sum += lat;
+            ops += threads[k].ops;
+            if (verbose > 1)
+                printf("    thread %d: %.0f requests, %.0f ns/request\n", k,
+                       threads[k].ops, lat);
+            free_trace(threads[k].trace);
+        }
+        double tput = ops / (secs * 1000.0);
+        if (n == 1)
+        {
+            base_tput = tput;
+            one_peak = mem_peak_footprint();
+        }
+        printf("%8d %10.0f %8.2f   %6.0f %6.0f %6.0f\n", n, tput,
+               tput / base_tput, lat_min, lat_sum / n, lat_max);
+        if (n == 1 && (tput > single_tput * THREAD_TOLERANCE ||
+                       tput * THREAD_TOLERANCE < single_tput))
+            fprintf(stderr,
+                    "Warning: %.0f Kops/sec on one thread, but %.0f "
+                    "Kops/sec measured without threads\n",
+                    tput, single_tput);
+        if (n == max_threads)
+            break;
+    }
+
+    /* The other replays use a single arena */
+    mm_mallopt(MM_ARENA_MAX, 1);
+    free(include);
+    free(root);
+}
+
 /*
  * usage - Explain the command line arguments
  */
@@ -2013,5 +3749,29 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-K <k>     Stop find_fit after k fitting blocks "
+                    "(0: best fit).\n");
+    fprintf(stderr, "\t-I <k>     Check the whole heap every k "
+                    "mm_checkheap calls (debug).\n");
+    fprintf(stderr, "\t-B         Replay batch requests as single ones.\n");
+    fprintf(stderr, "\t-S         Free blocks with mm_free_sized.\n");
+    fprintf(stderr, "\t-M         Print allocator statistics per trace "
+                    "(make STATS=1).\n");
+    fprintf(stderr, "\t-P <b>     Sample one request per <b> bytes, write "
+                    "<trace>.prof.\n");
+    fprintf(stderr, "\t-R <file>  Reduce the -f trace while it fails, "
+                    "write it to <file>.\n");
+    fprintf(stderr, "\t-X <ns>    With -R, keep a request slower than "
+                    "<ns> instead.\n");
+    fprintf(stderr, "\t-j <n>     With -R, replay <n> candidates at a time "
+                    "(default: CPUs).\n");
+    fprintf(stderr, "\t-N <n>     Also replay each trace on 1 to <n> "
+                    "threads (0: CPUs).\n");
+    fprintf(stderr, "\t-W         With -N, each thread replays the whole "
+                    "trace.\n");
+    fprintf(stderr, "\t-L         Print percentiles of the time of each "
+                    "request type.\n");
+    fprintf(stderr, "\t-b         Write each trace in binary, as <trace>.bin, "
+                    "and exit.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
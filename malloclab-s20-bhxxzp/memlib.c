@@ -31,6 +31,17 @@
  *  in non-emulation, as it was to the same page as actual heap data.  But
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
+ *
+ * mem_sbrk accepts a negative increment to shrink the heap; the pages that
+ *  lie entirely above the new break are given back like unmapped ones.
+ *
+ * mem_map carves regions out of the top of the reserved address range, below
+ *  mem_max_addr, and the break may not grow past the lowest of them.  The
+ *  regions are kept in a table sorted by address.  When a region is unmapped,
+ *  its pages are given back: with madvise(MADV_FREE) in the dense heap, which
+ *  lets the kernel reclaim them lazily, and by returning its emulation pages
+ *  to a free list in the sparse heap.  Accesses between
+ *  the lowest region and mem_max_addr are emulated like heap accesses.
  */
 #include <assert.h>
 #include <errno.h>
@@ -45,6 +56,13 @@
 #include "config.h"
 #include "memlib.h"
 
+/* A region of memory mapped with mem_map */
+typedef struct
+{
+    unsigned char *lo; /* First byte of the region */
+    size_t len;        /* Length of the region in bytes */
+} mem_map_t;
+
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK
 {
@@ -73,6 +91,16 @@ static size_t num_free_pages = 0;          /* Number of free pages */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
 static size_t num_buckets = 0;             /* Number of buckets in page table */
 
+static mem_block_t *recycled_pages = NULL; /* Pages of unmapped regions */
+
+/* Mapped regions, sorted by address */
+static mem_map_t maps[MAX_MAPS];
+static size_t num_maps = 0;
+static unsigned char *map_floor; /* Lowest mapped address (or mem_max_addr) */
+static size_t map_bytes = 0;     /* Total size of the mapped regions */
+static size_t peak_footprint = 0; /* Max of heap size + map_bytes */
+static size_t extend_count = 0;   /* Calls to mem_sbrk that grew the heap */
+
 static bool checkUB = true; /* should sparse check for UB */
 
 void setUBCheck(bool val)
@@ -87,6 +115,9 @@ static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static bool is_emulated(const void *addr, size_t len);
+static void update_peak(void);
+static void release_pages(unsigned char *lo, size_t len);
 
 /*
  * mem_init - initialize the memory system model
@@ -176,14 +207,27 @@ void mem_reset_brk()
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
         num_free_pages = num_pages;
+        recycled_pages = NULL;
     }
     mem_brk = heap;
+
+    /* Drop every mapped region */
+    if (!sparse)
+    {
+        for (size_t i = 0; i < num_maps; i++)
+            madvise(maps[i].lo, maps[i].len, MADV_FREE);
+    }
+    num_maps = 0;
+    map_floor = mem_max_addr;
+    map_bytes = 0;
+    peak_footprint = 0;
+    extend_count = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap and gives the freed pages back.
  */
 void *mem_sbrk(intptr_t incr)
 {
@@ -192,13 +236,21 @@ void *mem_sbrk(intptr_t incr)
     bool ok = true;
     if (incr < 0)
     {
-        ok = false;
-        fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+        if ((size_t)(-incr) > (size_t)(mem_brk - heap))
+        {
+            fprintf(stderr,
+                    "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                    "bytes, below its start\n",
+                    -(long)incr);
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        /* The process break is left alone: libc may have moved it since */
+        mem_brk += incr;
+        release_pages(mem_brk, (size_t)(-incr));
+        return (void *)old_brk;
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (mem_brk + incr > map_floor)
     {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
@@ -218,6 +270,8 @@ void *mem_sbrk(intptr_t incr)
     if (ok)
     {
         mem_brk += incr;
+        extend_count++;
+        update_peak();
         return (void *)old_brk;
     }
     else
@@ -227,6 +281,126 @@ void *mem_sbrk(intptr_t incr)
     }
 }
 
+/*
+ * mem_map - map a region of len bytes (rounded up to MAP_PAGE_SIZE) at the
+ * highest free place above the break, first fit from the top.
+ */
+void *mem_map(size_t len)
+{
+    len = (len + MAP_PAGE_SIZE - 1) & ~(size_t)(MAP_PAGE_SIZE - 1);
+    if (len == 0 || num_maps == MAX_MAPS)
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    /* Look for a gap, from the top of the address range down */
+    unsigned char *top = mem_max_addr;
+    size_t i;
+    for (i = num_maps; i > 0; i--)
+    {
+        unsigned char *end = maps[i - 1].lo + maps[i - 1].len;
+        if ((size_t)(top - end) >= len)
+            break;
+        top = maps[i - 1].lo;
+    }
+    if ((size_t)(top - mem_brk) < len)
+    {
+        fprintf(stderr,
+                "ERROR: mem_map failed. Ran out of memory.  Would require a "
+                "region of %zd (0x%zx) bytes\n",
+                len, len);
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    /* The new region goes right below top, as maps[i] */
+    memmove(&maps[i + 1], &maps[i], (num_maps - i) * sizeof(mem_map_t));
+    maps[i].lo = top - len;
+    maps[i].len = len;
+    num_maps++;
+    if (maps[i].lo < map_floor)
+        map_floor = maps[i].lo;
+    map_bytes += len;
+    update_peak();
+    return (void *)maps[i].lo;
+}
+
+/*
+ * mem_unmap - unmap a region returned by mem_map and give its pages back
+ */
+bool mem_unmap(void *addr, size_t len)
+{
+    len = (len + MAP_PAGE_SIZE - 1) & ~(size_t)(MAP_PAGE_SIZE - 1);
+    size_t i;
+    for (i = 0; i < num_maps; i++)
+    {
+        if (maps[i].lo == (unsigned char *)addr)
+            break;
+    }
+    if (i == num_maps || maps[i].len != len)
+    {
+        fprintf(stderr, "ERROR: mem_unmap failed.  No region of %zu bytes "
+                        "mapped at %p\n",
+                len, addr);
+        return false;
+    }
+
+    release_pages(maps[i].lo, len);
+    map_bytes -= len;
+    num_maps--;
+    memmove(&maps[i], &maps[i + 1], (num_maps - i) * sizeof(mem_map_t));
+    map_floor = num_maps > 0 ? maps[0].lo : mem_max_addr;
+    return true;
+}
+
+/*
+ * mem_is_mapped - check that [addr, addr + len) lies in one mapped region
+ */
+bool mem_is_mapped(const void *addr, size_t len)
+{
+    const unsigned char *lo = (const unsigned char *)addr;
+    if (lo < map_floor)
+        return false;
+    /* Binary search for the last region starting at or below addr */
+    size_t l = 0, r = num_maps;
+    while (r - l > 1)
+    {
+        size_t m = (l + r) / 2;
+        if (maps[m].lo <= lo)
+            l = m;
+        else
+            r = m;
+    }
+    return num_maps > 0 && maps[l].lo <= lo &&
+           (size_t)(lo - maps[l].lo) + len <= maps[l].len;
+}
+
+/*
+ * mem_mapsize - returns the total size of the mapped regions in bytes
+ */
+size_t mem_mapsize()
+{
+    return map_bytes;
+}
+
+/*
+ * mem_peak_footprint - returns the largest heap size + mapped size seen
+ */
+size_t mem_peak_footprint()
+{
+    return peak_footprint;
+}
+
+/*
+ * mem_extend_count - returns the number of successful calls to mem_sbrk with
+ * a nonnegative increment since the last mem_reset_brk
+ */
+size_t mem_extend_count()
+{
+    return extend_count;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -279,8 +453,7 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (sparse && is_emulated(addr, len))
     {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
@@ -323,8 +496,7 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (sparse && is_emulated(addr, len))
     {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
@@ -419,13 +591,14 @@ void hprobe(void *ptr, int offset, size_t count)
     unsigned char *cptr_lo = cptr + offset;
     unsigned char *cptr_hi = cptr_lo + count - 1;
     unsigned char *iptr;
-    if ((void *)cptr_lo < mem_heap_lo())
+    bool mapped = mem_is_mapped(cptr_lo, count);
+    if (!mapped && (void *)cptr_lo < mem_heap_lo())
     {
         fprintf(stderr, "Invalid probe.  Address %p is below start of heap\n",
                 cptr_lo);
         return;
     }
-    if ((void *)cptr_hi > mem_heap_hi())
+    if (!mapped && (void *)cptr_hi > mem_heap_hi())
     {
         fprintf(stderr, "Invalid probe.  Address %p is beyond end of heap\n",
                 cptr_lo);
@@ -443,6 +616,52 @@ void hprobe(void *ptr, int offset, size_t count)
 
 /*************** Private Functions *******************/
 
+/* Is [addr, addr + len) in the heap or in the mapped part of the range? */
+static bool is_emulated(const void *addr, size_t len)
+{
+    unsigned char *lo = (unsigned char *)addr;
+    return (lo >= heap && lo + len <= mem_brk) ||
+           (lo >= map_floor && lo + len <= mem_max_addr);
+}
+
+/* Record the current footprint if it is the largest one so far */
+static void update_peak(void)
+{
+    size_t footprint = mem_heapsize() + map_bytes;
+    if (footprint > peak_footprint)
+        peak_footprint = footprint;
+}
+
+/* Give back the pages that lie entirely within [lo, lo + len) */
+static void release_pages(unsigned char *lo, size_t len)
+{
+    size_t page = sparse ? SPARSE_PAGE_SIZE : MAP_PAGE_SIZE;
+    size_t first = ((size_t)(lo - heap) + page - 1) / page;
+    size_t end = (size_t)(lo + len - heap) / page;
+    if (first >= end)
+        return;
+    if (!sparse)
+    {
+        madvise(heap + first * page, (end - first) * page, MADV_FREE);
+        return;
+    }
+    /* Move the emulation pages of the range to the recycled list */
+    for (size_t id = first; id < end; id++)
+    {
+        mem_block_t **link = &page_table[id % num_buckets];
+        while (*link && (*link)->id != id)
+            link = &(*link)->next;
+        if (*link)
+        {
+            mem_block_t *block = *link;
+            *link = block->next;
+            block->next = recycled_pages;
+            recycled_pages = block;
+            num_free_pages++;
+        }
+    }
+}
+
 static void print_stats()
 {
     size_t vbytes = mem_heapsize();
@@ -503,7 +722,13 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (recycled_pages)
+        {
+            block = recycled_pages;
+            recycled_pages = block->next;
+        }
+        else
+            block = next_free_page++;
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
@@ -22,17 +22,64 @@ void mem_init(bool sparse);
 void mem_deinit(void);
 
 /**
- * @brief Extends the heap by incr bytes.
+ * @brief Extends the heap by incr bytes, or shrinks it if incr is negative.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. When the heap
+ * shrinks, the pages above the new break are given back.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous break point)
- * @pre `incr > 0`
+ * @pre `mem_heapsize() + incr >= 0`
  */
 void *mem_sbrk(intptr_t incr);
 
+/**
+ * @brief Maps a region of memory outside of the heap, like mmap.
+ *
+ * Regions are placed at the top of the address range reserved for the heap
+ * and grow down towards the break; the heap cannot grow into them.
+ *
+ * @param[in] len The size of the region, rounded up to a multiple of the page
+ * @return The start of the region (page aligned), or (void *)-1 on failure
+ */
+void *mem_map(size_t len);
+
+/**
+ * @brief Unmaps a region returned by mem_map, giving its pages back.
+ * @param[in] addr The start of the region
+ * @param[in] len  The length passed to mem_map
+ * @return True on success, false if no region was mapped at addr
+ */
+bool mem_unmap(void *addr, size_t len);
+
+/**
+ * @brief Checks that a range of bytes lies within a single mapped region.
+ * @param[in] addr The first byte of the range
+ * @param[in] len  The number of bytes in the range
+ * @return True if the whole range is mapped
+ */
+bool mem_is_mapped(const void *addr, size_t len);
+
+/**
+ * @brief Returns the number of bytes currently mapped with mem_map.
+ * @return The total size of the mapped regions, in bytes
+ */
+size_t mem_mapsize(void);
+
+/**
+ * @brief Returns the largest memory footprint (heap plus mapped regions)
+ *        since the last mem_reset_brk.
+ * @return The peak footprint, in bytes
+ */
+size_t mem_peak_footprint(void);
+
+/**
+ * @brief Returns how many times mem_sbrk extended the heap since the last
+ *        mem_reset_brk.
+ * @return The number of successful calls with a nonnegative increment
+ */
+size_t mem_extend_count(void);
+
 /**
  * @brief Resets the simulated brk pointer to make an empty heap.
  */
@@ -0,0 +1,157 @@
+#!/usr/bin/perl
+use Getopt::Std;
+
+##############################################################################
+#
+# This program reads a profile written by mm_profile_dump (or mdriver -P) and
+# prints the allocation sites that hold the most live bytes and the ones that
+# allocate and free the most bytes. A sample stands for about `rate` bytes,
+# so a request of size s sampled once counts for max(s, rate) bytes.
+#
+##############################################################################
+
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-h] [-n COUNT] [-e BINARY] -f PROFILE\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h              Print this message\n";
+    printf STDERR "  -n COUNT        Number of sites per table (default 10)\n";
+    printf STDERR "  -e BINARY       Name the sites with addr2line on BINARY\n";
+    printf STDERR "  -f PROFILE      Specify the profile\n";
+    die "\n" ;
+}
+
+# The entry points of the allocator, skipped when looking for the caller
+$alloc_funcs = "^(mm_)?(malloc|calloc|realloc|memalign|aligned_alloc|" .
+    "malloc_batch)\$";
+
+$top = 10;
+
+getopts('hn:e:f:');
+
+if ($opt_h) {
+    usage($ARGV[0]);
+}
+
+if (!$opt_f) {
+    usage("Missing profile");
+}
+
+if ($opt_n) {
+    $top = $opt_n;
+}
+
+open(PROF, "<", $opt_f) || die "Couldn't open profile '$opt_f'\n";
+binmode(PROF);
+{
+    local $/;
+    $data = <PROF>;
+}
+close(PROF);
+
+($magic, $rate, $nr, $dropped, $anchor, $dump_ns) =
+    unpack("Z8 Q Q Q Q Q", substr($data, 0, 48));
+if ($magic ne "MMPROF1") {
+    die "$opt_f is not a profile\n";
+}
+if ($nr == 0) {
+    print "No samples in $opt_f\n";
+    exit(0);
+}
+$sample_size = (length($data) - 48) / $nr;
+$depth = $sample_size / 8 - 5;
+
+# Map the return addresses to functions and lines of the binary, relocated
+# with the address mm_init had at run time
+%names = ();
+$offset = 0;
+if ($opt_e) {
+    foreach $line (`nm $opt_e`) {
+        if ($line =~ /^([0-9a-f]+) [Tt] mm_init$/) {
+            $offset = hex($1) - $anchor;
+        }
+    }
+}
+
+sub name_of
+{
+    my ($pc) = @_;
+    if (!exists($names{$pc})) {
+        # A return address points after the call, name the call itself
+        my $addr = sprintf("0x%x", $pc + $offset - 1);
+        my ($func, $where) = ("?", "?");
+        if ($opt_e) {
+            ($func, $where) = `addr2line -f -s -e $opt_e $addr`;
+            chomp($func);
+            chomp($where);
+        }
+        $names{$pc} = [$func, $where];
+    }
+    return @{$names{$pc}};
+}
+
+# Aggregate the samples by the first frame outside the allocator
+%live_bytes = ();
+%live_count = ();
+%churn_bytes = ();
+%churn_count = ();
+%lifetime = ();
+%site_name = ();
+for ($i = 0; $i < $nr; $i++) {
+    @s = unpack("Q5 Q$depth", substr($data, 48 + $i * $sample_size,
+                                     $sample_size));
+    ($addr, $size, $alloc_ns, $free_ns, $n) = splice(@s, 0, 5);
+    $site = $s[0];
+    $label = sprintf("0x%x", $site);
+    for ($j = 0; $j < $n; $j++) {
+        ($func, $where) = name_of($s[$j]);
+        $site = $s[$j];
+        $label = $opt_e ? "$func ($where)" : sprintf("0x%x", $site);
+        last if ($func !~ /$alloc_funcs/);
+    }
+    $site_name{$site} = $label;
+
+    $bytes = ($size > $rate) ? $size : $rate;
+    $count = ($size > $rate || $size == 0) ? 1 : $rate / $size;
+    if ($free_ns == 0) {
+        $live_bytes{$site} += $bytes;
+        $live_count{$site} += $count;
+    }
+    else {
+        $churn_bytes{$site} += $bytes;
+        $churn_count{$site} += $count;
+        $lifetime{$site} += ($free_ns - $alloc_ns);
+        $freed{$site}++;
+    }
+}
+
+printf("%s: %d samples, one per %d bytes", $opt_f, $nr, $rate);
+printf(", %d dropped", $dropped) if ($dropped);
+print "\n";
+
+sub print_table
+{
+    my ($title, $bytes, $count) = @_;
+    my @sites = sort { $bytes->{$b} <=> $bytes->{$a} } keys %$bytes;
+    print "\n$title\n";
+    if ($#sites < 0) {
+        print "  (none)\n";
+        return;
+    }
+    printf("  %12s %10s %12s  %s\n", "bytes", "blocks", "lifetime us",
+           "site");
+    splice(@sites, $top) if ($#sites >= $top);
+    foreach $site (@sites) {
+        my $life = $freed{$site} ?
+            sprintf("%.1f", $lifetime{$site} / $freed{$site} / 1000) : "-";
+        $life = "-" if ($bytes == \%live_bytes);
+        printf("  %12.0f %10.0f %12s  %s\n", $bytes->{$site}, $count->{$site},
+               $life, $site_name{$site});
+    }
+}
+
+print_table("Live at the dump, by estimated bytes:", \%live_bytes,
+            \%live_count);
+print_table("Allocated and freed, by estimated bytes:", \%churn_bytes,
+            \%churn_count);
@@ -14,6 +14,64 @@
  * has the header and the next pointer. The allocated block only has header and
  * the payload. The minimum block size is 16 for this lab
  *
+ * All allocator state (the segregated lists and the chain of heap segments)
+ * lives in an arena, which is itself stored at the start of its heap region.
+ * By default there is a single arena and no locking at all. When
+ * mm_mallopt(MM_ARENA_MAX, n) is set before mm_init, each thread binds to
+ * one of up to n arenas. Every arena claims the heap in whole granules, and
+ * a byte map from granule to arena id lets free route a block back to the
+ * arena that owns it, whichever thread calls it.
+ *
+ * The free blocks of the largest size class (128 KB and up) are not kept in
+ * a list but in a splay tree ordered by size and then address, whose nodes
+ * live in the free blocks themselves, so a large request finds its best fit
+ * in O(log n) amortized.
+ *
+ * A header is 32 bits, in the upper half of a word whose lower half ends
+ * the previous block, so an allocated block only costs 4 bytes. Heap blocks
+ * are therefore below 4 GB: larger requests are always mapped, and the
+ * size of a mapped region is kept in the word before its header.
+ *
+ * Requests of at least mmap_threshold bytes (1 MB by default) bypass the
+ * arenas: each one gets a region of its own from mem_map, marked with the
+ * mapped bit in its header, which goes back to the system as soon as the
+ * block is freed instead of staying in the heap forever.
+ *
+ * When a free block at the end of the heap grows past trim_threshold
+ * (256 KB by default), all but chunksize bytes of it are given back with a
+ * negative mem_sbrk, so the heap shrinks again after a burst.
+ *
+ * Requests of up to 48 bytes are served from slabs: 1 KB blocks of the
+ * arena, aligned on their size, cut into headerless slots of 16, 32 or 48
+ * bytes, with a bitmap of the free slots at the start of the slab. A bit per
+ * KB of heap marks the ones that start a slab, so free finds the slab of a
+ * pointer in O(1) and the slot needs no header at all. Slabs are only used
+ * once the heap holds 16 KB, and only for sizes whose slot is smaller than
+ * the heap block they would get.
+ *
+ * Blocks freed past the thread cache are not coalesced right away either:
+ * they are parked, still marked allocated, in the unsorted bin of their
+ * arena. The bin is consolidated in one pass when find_fit fails or when it
+ * holds unsorted_max blocks: sorted by address, each run of neighbouring
+ * parked blocks is merged and coalesced once.
+ *
+ * mm_memalign carves its blocks out of the heap with the same routine as the
+ * slabs: the payload is placed on the boundary and the skipped bytes become
+ * a free block in front of it.
+ *
+ * In front of the arenas every thread keeps a small cache of freed blocks of
+ * up to 128 bytes, one LIFO stack per block size. Blocks in the cache stay
+ * marked allocated in the heap, so malloc can pop one and free can push one
+ * without rewriting any header or taking any lock. The cache is flushed back
+ * to the arenas before the heap is extended, so it never makes the heap grow.
+ *
+ * With mm_mallopt(MM_PROFILE_RATE, r), about one request per r bytes is
+ * sampled, at a random distance so that regular patterns do not alias: its
+ * size, backtrace and allocation time are recorded, and its free time when
+ * free finds it in a small table of live samples. A per-bucket count lets
+ * free skip that table without a lock for almost every block.
+ * mm_profile_dump writes the samples out for mm-prof.pl.
+ *
  *************************************************************************
  *
  * ADVICE FOR STUDENTS.
@@ -29,12 +87,16 @@
  */
 
 #include <assert.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "memlib.h"
@@ -71,6 +133,7 @@
 #define dbg_assert(expr) assert(expr)
 #define dbg_ensures(expr) assert(expr)
 #define dbg_printheap(...) print_heap(__VA_ARGS__)
+#define dbg_touch(block) touch_block(block)
 #else
 /* When DEBUG is not defined, no code gets generated for these */
 /* The sizeof() hack is used to avoid "unused variable" warnings */
@@ -79,6 +142,44 @@
 #define dbg_assert(expr) (sizeof(expr), 1)
 #define dbg_ensures(expr) (sizeof(expr), 1)
 #define dbg_printheap(...) ((void)sizeof(__VA_ARGS__))
+#define dbg_touch(block) ((void)sizeof(block))
+#endif
+
+/*
+ * Number of mm_checkheap calls between two full sweeps of the heap. The calls
+ * in between only check the blocks whose header was written since the last
+ * call, and their neighbours (0: sweep every time). Only debug builds log the
+ * written blocks, others always sweep. Can be set with -DCHECK_INTERVAL=k at
+ * build time, or with mm_mallopt.
+ */
+#ifndef CHECK_INTERVAL
+#define CHECK_INTERVAL 0
+#endif
+
+/*
+ * Number of fitting blocks find_fit compares before it settles for the best
+ * one seen so far (0: scan the whole first non-empty list, i.e. best fit).
+ * Can be set with -DFIT_DEPTH=k at build time, or with mm_mallopt.
+ */
+#ifndef FIT_DEPTH
+#define FIT_DEPTH 0
+#endif
+
+/*
+ * If nonzero, the counters read by mm_get_stats are kept up to date on the
+ * hot path. Otherwise every update is dead code. Set with -DMM_STATS=1.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+
+/*
+ * If nonzero, an allocated block only pays for its 4-byte header: its payload
+ * runs into the low half of the next header word. Set with -DCOMPACT_HEADER=0
+ * to keep the whole word as overhead, e.g. to compare utilization.
+ */
+#ifndef COMPACT_HEADER
+#define COMPACT_HEADER 1
 #endif
 
 /* Basic constants */
@@ -94,6 +195,24 @@ static const size_t dsize = 2 * wsize;
 /** @brief Minimum block size (32 bytes) */
 static const size_t min_block_size = dsize;
 
+/**
+ * Bytes of an allocated heap block that are not payload
+ */
+static const size_t block_overhead =
+    COMPACT_HEADER ? sizeof(uint32_t) : sizeof(word_t);
+
+/**
+ * Largest heap block, whose size still fits a 32-bit header. Free neighbours
+ * stay apart rather than exceed it
+ */
+static const size_t max_block_size = ((size_t)1 << 32) - dsize;
+
+/**
+ * Requests of at least this size are always mapped: with the rounding of a
+ * heap extension, their block could not be kept under max_block_size
+ */
+static const size_t huge_size = ((size_t)1 << 31);
+
 /**
  * The size of the free block we assign at first time
  * or the default block size to expend
@@ -101,6 +220,17 @@ static const size_t min_block_size = dsize;
  */
 static const size_t chunksize = (1 << 12);
 
+/**
+ * Upper bound of the adaptive extension size of an arena
+ */
+static const size_t grow_limit = (1 << 20);
+
+/**
+ * The extension size never exceeds 1 / 2^grow_shift of the heap, which
+ * bounds the bytes left unused past the last block at the peak
+ */
+static const size_t grow_shift = 7;
+
 /**
  * alloc_mask to get the last alloc bit
  */
@@ -116,43 +246,380 @@ static const word_t prev_alloc_mask = 0x2;
  */
 static const word_t mini_mask = 0x4;
 
+/**
+ * mapped_mask to know that a block has a mapped region of its own
+ */
+static const word_t mapped_mask = 0x8;
+
 /**
  * size_mask to get the size bits of the block
  */
 static const word_t size_mask = ~(word_t)0xF;
 
 /**
- * 128 Bytes - 8 Bytes(Header) = 120
- * 120 / 8 = 15 Bytes
- * Should smaller than 15
+ * Number of segregated lists: 16, 32 and 48 bytes, then 4 classes per power
+ * of two from 64 bytes on, the last one taking every block from 128 KB up
+ * (at most 64, one bit each in the arena's list_map). The last class is kept
+ * in a splay tree instead of a list, see tree_insert. Must match
+ * MM_STATS_CLASSES in mm.h
+ */
+static const size_t list_number = 48;
+
+/**
+ * Blocks below this size have one class per multiple of dsize
+ */
+static const size_t small_class_limit = 4 * dsize;
+
+/**
+ * log2 of the number of classes per power of two above small_class_limit
+ */
+static const size_t class_bits = 2;
+
+/**
+ * Granule in which arenas claim heap memory when there is more than one
+ * arena. Each granule belongs to exactly one arena (must be a power of 2)
+ */
+static const size_t arena_grain = (1 << 16);
+
+/**
+ * Number of granules covered by the ownership map (1 GB of heap)
+ */
+static const size_t arena_map_size = (1 << 14);
+
+/**
+ * Upper bound of MM_ARENA_MAX, arena ids are stored in one byte
+ */
+static const size_t arena_limit = 64;
+
+/**
+ * Largest block size kept in the thread cache, which has one bin per
+ * multiple of dsize up to it
+ */
+static const size_t tcache_max_size = (1 << 7);
+
+/**
+ * Number of thread cache bins (tcache_max_size / dsize)
+ */
+static const size_t tcache_bins = 8;
+
+/**
+ * Size of the block of a slab and alignment of its payload (a power of 2, at
+ * most 64 slots of 16 bytes); the slab map has a bit per slab_size bytes of
+ * heap, called a page there
+ */
+static const size_t slab_size = (1 << 10);
+
+/**
+ * Largest request served from a slab; slots are 16, 32 or 48 bytes
+ */
+static const size_t slab_max_size = 3 * dsize;
+
+/**
+ * Heap size from which tiny requests go to slabs; below it, a slab per slot
+ * size may hold more free slots than there is live data
+ */
+static const size_t slab_min_heap = (1 << 14);
+
+/**
+ * Number of slot sizes (slab_max_size / dsize)
+ */
+static const size_t slab_classes = 3;
+
+/**
+ * Words in the free slot bitmap of a slab (slab_size / dsize / 64)
+ */
+static const size_t slab_map_words = 1;
+
+/**
+ * Upper bound of MM_TCACHE_COUNT
+ */
+static const size_t tcache_count_limit = 64;
+
+/**
+ * Default of MM_UNSORTED_MAX: parked blocks that trigger a consolidation
+ */
+static const size_t unsorted_max_default = 32;
+
+/**
+ * Default of MM_MMAP_THRESHOLD: blocks of at least this size are mapped
+ */
+static const size_t mmap_threshold_default = (1 << 20);
+
+/**
+ * Default of MM_TRIM_THRESHOLD: a free block of at least this size at the
+ * end of the heap is given back to the system
+ */
+static const size_t trim_threshold_default = (1 << 18);
+
+/**
+ * Blocks the incremental heap checker can log between two calls; past that
+ * the next call sweeps the whole heap
+ */
+static const size_t touch_capacity = 256;
+
+/**
+ * Frames kept in the backtrace of a profile sample
+ */
+static const size_t prof_depth = 8;
+
+/**
+ * Samples the profiler can hold until the next mm_profile_dump
+ */
+static const size_t prof_capacity = (1 << 12);
+
+/**
+ * Slots of the hash table of live samples (a power of 2, at least twice
+ * prof_capacity)
  */
-static const size_t list_number = 14;
+static const size_t prof_table_size = (1 << 13);
 
 /**
- * Initialize the range of the list
+ * Buckets of the filter that lets free skip the table (a power of 2)
  */
-static const size_t list_index = 1;
+static const size_t prof_filter_size = (1 << 12);
 
-static size_t times = 0;
+/**
+ * @brief One sampled allocation, as written to the profile log.
+ *
+ * Times are CLOCK_MONOTONIC nanoseconds. The backtrace starts at the caller
+ * of the allocator.
+ */
+typedef struct prof_sample {
+    /** @brief Payload address, the key of the live sample table */
+    uint64_t addr;
+    /** @brief Requested size */
+    uint64_t size;
+    uint64_t alloc_ns;
+    /** @brief 0 while the block is live */
+    uint64_t free_ns;
+    /** @brief Number of valid entries in pcs */
+    uint64_t depth;
+    uint64_t pcs[prof_depth];
+} prof_sample_t;
+
+/**
+ * @brief Header of the profile log, followed by nr_samples samples.
+ *
+ * anchor is the run-time address of mm_init, so that a tool can relocate
+ * the return addresses of a position independent binary.
+ */
+typedef struct prof_header {
+    char magic[8];
+    uint64_t rate;
+    uint64_t nr_samples;
+    uint64_t dropped;
+    uint64_t anchor;
+    uint64_t dump_ns;
+} prof_header_t;
 
-/** @brief Represents the header and payload of one block in the heap */
+/**
+ * @brief Represents the header and payload of one block in the heap.
+ *
+ * The header is the high half of the word in front of the payload, so that
+ * the payload stays 16-byte aligned. The low half is never written by the
+ * block itself: it ends the payload of the previous block when that one is
+ * allocated.
+ */
 typedef struct block {
+    /** @brief Last bytes of the payload of the previous block */
+    uint32_t prev_tail;
     /** @brief Header contains size + allocation flag */
-    word_t header;
+    uint32_t header;
     union {
         struct {
             struct block *next;
             struct block *prev;
         } free_block;
+        /** @brief Links of a free block of the largest class, a tree node */
+        struct {
+            struct block *left;
+            struct block *right;
+            struct block *parent;
+        } tree_node;
         char payload[0];
     } info;
 } block_t;
 
+/**
+ * @brief Start of a contiguous run of blocks obtained from mem_sbrk.
+ *
+ * The prologue is the last word so that the first block header right after
+ * it keeps the payload 16-byte aligned. A segment ends with an epilogue.
+ */
+typedef struct segment {
+    /** @brief Segment created before this one in the same arena */
+    struct segment *next;
+    word_t unused;
+    /** @brief Prologue footer (size 0, allocated) */
+    word_t prologue;
+} segment_t;
+
+/** @brief Allocator state of one arena, stored at the start of its heap */
+typedef struct arena {
+    /** @brief The list of all the segregate lists */
+    block_t *seg_list[list_number];
+    /** @brief Bit i is set when seg_list[i] is not empty */
+    uint64_t list_map;
+    /** @brief Newest segment, linking to the older ones */
+    segment_t *segments;
+    /** @brief Break address right after the newest segment */
+    char *seg_end;
+    /** @brief Size of the next heap extension, see extend_size */
+    size_t grow;
+    /** @brief Slabs with at least one free slot, for each slot size */
+    struct slab *slabs[slab_classes];
+    /** @brief Freed blocks not coalesced yet, still marked allocated */
+    block_t *unsorted;
+    /** @brief Number of blocks in the unsorted bin */
+    size_t nr_unsorted;
+    /** @brief Index of this arena in the arena table */
+    size_t id;
+    /** @brief Serializes the arena, only used in arena mode */
+    pthread_mutex_t lock;
+} arena_t;
+
+/**
+ * @brief Per-thread cache of freed small blocks.
+ *
+ * Each bin is a stack of blocks of one size linked through the first payload
+ * word. The cached blocks keep their allocated headers.
+ */
+typedef struct tcache {
+    /** @brief Top of the stack of each bin */
+    block_t *entries[tcache_bins];
+    /** @brief Number of blocks in each bin */
+    size_t counts[tcache_bins];
+    /** @brief heap_epoch the cached blocks belong to */
+    size_t epoch;
+} tcache_t;
+
+/**
+ * @brief Header of a slab, at the start of the payload of its block.
+ *
+ * The slots follow the header. A slab is linked in its arena's list for its
+ * slot size as long as it has a free slot.
+ */
+typedef struct slab {
+    /** @brief Neighbours in the list of slabs with free slots */
+    struct slab *next;
+    struct slab *prev;
+    /** @brief Arena the block of the slab belongs to */
+    arena_t *arena;
+    /** @brief Size of every slot */
+    size_t slot_size;
+    /** @brief Number of free slots */
+    size_t nr_free;
+    /** @brief Bit i is set when slot i is free */
+    uint64_t free_map[slab_map_words];
+} slab_t;
+
+/** @brief Bytes before the first block and after the last one of a segment */
+static const size_t segment_overhead = sizeof(segment_t) + sizeof(word_t);
+
 /* Global variables */
-static block_t *seg_list[list_number]; // the list of all the segregate lists
 
-/** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
+/** @brief The arena created by mm_init; the only one unless in arena mode */
+static arena_t *main_arena = NULL;
+
+/** @brief Table of arenas by id, stored in the heap (arena mode only) */
+static arena_t **arenas = NULL;
+
+/** @brief Owner arena id of every heap granule (arena mode only) */
+static uint8_t *arena_map = NULL;
+
+/** @brief Number of arenas created / threads bound since mm_init */
+static size_t nr_arenas = 0;
+static size_t nr_bound = 0;
+
+/** @brief Maximum number of arenas, as set by mm_mallopt */
+static size_t arena_max = 1;
+
+/** @brief Size of the arena table, arena_max as of the last mm_init */
+static size_t arena_slots = 0;
+
+/** @brief True when mm_init set up more than one arena */
+static bool arena_mode = false;
+
+/** @brief Bumped by every mm_init to invalidate the thread bindings */
+static size_t heap_epoch = 0;
+
+/** @brief Protects mem_sbrk, the ownership map and the arena table */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Arena this thread allocates from, valid for thread_epoch */
+static __thread arena_t *thread_arena = NULL;
+static __thread size_t thread_epoch = 0;
+
+/** @brief Maximum number of blocks per thread cache bin, set by mm_mallopt */
+static size_t tcache_count = 7;
+
+/** @brief Fitting candidates find_fit compares, 0 for no bound */
+static size_t fit_depth = FIT_DEPTH;
+
+/** @brief Parked blocks that trigger a consolidation, 0 to never park */
+static size_t unsorted_max = unsorted_max_default;
+
+/** @brief Smallest block size given a mapped region, 0 to never map */
+static size_t mmap_threshold = mmap_threshold_default;
+
+/** @brief Smallest free block at the end of the heap to trim, 0 for never */
+static size_t trim_threshold = trim_threshold_default;
+
+/** @brief mm_checkheap calls between full sweeps, 0 to always sweep */
+static size_t check_interval = CHECK_INTERVAL;
+static size_t checks_since_sweep = 0;
+
+/** @brief Blocks whose header was written since the last mm_checkheap, in
+ * debug builds; touch_overflow is set when they did not all fit */
+static block_t *touched[touch_capacity];
+static size_t nr_touched = 0;
+static bool touch_overflow = false;
+#ifdef DEBUG
+static const bool touch_logged = true;
+#else
+static const bool touch_logged = false;
+#endif
+
+/** @brief Thread cache of the calling thread */
+static __thread tcache_t tcache;
+
+/** @brief Key whose destructor flushes the cache of an exiting thread */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/** @brief Bit per heap page, set when a slab starts at the page, stored in
+ * the heap; it covers the whole ownership map range in arena mode and is an
+ * allocated block that grows with the heap otherwise */
+static uint64_t *slab_map = NULL;
+static size_t slab_map_pages = 0;
+
+/** @brief Counters of mm_get_stats, only updated when MM_STATS is set */
+static mm_stats_t counters;
+
+/** @brief Mean bytes allocated between two samples, 0: profiler off */
+static size_t prof_rate = 0;
+
+/** @brief Serializes the samples, the live table and its filter */
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Samples since the last dump; those not freed are in prof_table */
+static prof_sample_t prof_samples[prof_capacity];
+static size_t prof_nr = 0;
+static size_t prof_dropped = 0;
+
+/** @brief Open addressing table of the live samples, index + 1 (0: empty) */
+static uint32_t prof_table[prof_table_size];
+static size_t prof_live = 0;
+
+/** @brief Live samples per hash bucket, read by free without the lock */
+static uint16_t prof_filter[prof_filter_size];
+
+/** @brief Bytes the calling thread still allocates before its next sample,
+ * the state of its random interval generator, and a guard against the
+ * allocations of backtrace itself */
+static __thread size_t prof_countdown = 0;
+static __thread uint64_t prof_seed = 0;
+static __thread bool prof_busy = false;
 
 /*
  *****************************************************************************
@@ -181,8 +648,25 @@ static void write_footer(block_t *block, size_t size, bool alloc,
 static void write_header(block_t *block, size_t size, bool alloc,
                          bool prev_alloc, bool prev_mini);
 static size_t get_index(size_t asize);
-static void delete_block(block_t *block);
-static void insert_block(block_t *block);
+static void delete_block(arena_t *arena, block_t *block);
+static void insert_block(arena_t *arena, block_t *block);
+static bool check_arena(arena_t *arena, int line);
+static bool check_arena_step(arena_t *arena, int line);
+static bool check_slabs(arena_t *arena, int line);
+static bool check_tcache(int line);
+static bool check_unsorted(arena_t *arena, int line);
+static bool check_free_size(void *bp, size_t size, int line);
+static void release_block(block_t *block);
+static void free_block(arena_t *arena, block_t *block);
+static bool tcache_flush(void);
+static void tcache_key_create(void);
+static void tcache_exit(void *cache);
+static bool consolidate(arena_t *arena);
+static block_t *sort_by_address(block_t *list);
+static void free_sorted(arena_t *arena, block_t *block);
+static block_t *find_fit(arena_t *arena, size_t asize);
+static slab_t *find_slab(void *bp);
+static size_t slab_slots(size_t slot_size);
 bool mm_init(void);
 /**
  * @brief Returns the maximum of two integers.
@@ -194,6 +678,16 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * @brief Returns the minimum of two integers.
+ * @param[in] x
+ * @param[in] y
+ * @return `x` if `x < y`, and `y` otherwise.
+ */
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
 /**
  * @brief Rounds `size` up to next multiple of n
  * @param[in] size
@@ -204,6 +698,65 @@ static size_t round_up(size_t size, size_t n) {
     return n * ((size + (n - 1)) / n);
 }
 
+/**
+ * @brief Adds to a counter of mm_get_stats. Threads may share the counter,
+ *        hence the atomic update; nothing is done unless MM_STATS is set.
+ * @param[in] counter
+ * @param[in] n
+ */
+static void stat_add(size_t *counter, size_t n) {
+    if (MM_STATS) {
+        __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Subtracts from a counter of mm_get_stats, see stat_add.
+ * @param[in] counter
+ * @param[in] n
+ */
+static void stat_sub(size_t *counter, size_t n) {
+    if (MM_STATS) {
+        __atomic_fetch_sub(counter, n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Adds bytes given to the user to bytes_in_use, and to its peak.
+ * @param[in] size
+ */
+static void stat_use(size_t size) {
+    if (MM_STATS) {
+        size_t used = __atomic_add_fetch(&counters.bytes_in_use, size,
+                                         __ATOMIC_RELAXED);
+        if (used > __atomic_load_n(&counters.peak_in_use, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&counters.peak_in_use, used, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Counts a block of the given size handed out to the user.
+ * @param[in] size
+ */
+static void stat_alloc(size_t size) {
+    if (MM_STATS) {
+        stat_add(&counters.classes[get_index(size)].allocs, 1);
+        stat_use(size);
+    }
+}
+
+/**
+ * @brief Counts a block of the given size given back by the user.
+ * @param[in] size
+ */
+static void stat_free(size_t size) {
+    if (MM_STATS) {
+        stat_add(&counters.classes[get_index(size)].frees, 1);
+        stat_sub(&counters.bytes_in_use, size);
+    }
+}
+
 /**
  * @brief Packs the `size` and `alloc` of a block into a word suitable for
  *        use as a packed value.
@@ -295,6 +848,28 @@ static block_t *footer_to_header(word_t *footer) {
     return (block_t *)((char *)footer + wsize - size);
 }
 
+/**
+ * @brief Returns whether a block has a mapped region of its own.
+ * @param[in] block
+ * @return True if the block was allocated by map_block
+ */
+static bool get_mapped(block_t *block) {
+    return (bool)(block->header & mapped_mask);
+}
+
+/**
+ * @brief Returns the length of the region of a mapped block.
+ *
+ * It may not fit the header, so it is kept in the padding word in front of
+ * the block, and the size bits of the header are 0.
+ *
+ * @param[in] block A mapped block
+ * @return The length of its region
+ */
+static size_t get_mapped_size(block_t *block) {
+    return *((word_t *)block - 1);
+}
+
 /**
  * @brief Returns the payload size of a given block.
  *
@@ -305,8 +880,11 @@ static block_t *footer_to_header(word_t *footer) {
  * @return The size of the block's payload
  */
 static size_t get_payload_size(block_t *block) {
-    size_t asize = get_size(block);
-    return asize - wsize;
+    if (get_mapped(block)) {
+        // The region also holds a padding word in front of the header
+        return get_mapped_size(block) - dsize;
+    }
+    return get_size(block) - block_overhead;
 }
 
 /**
@@ -407,6 +985,23 @@ static block_t *find_prev_mini(block_t *block) {
     return (block_t *)((char *)block - dsize);
 }
 
+/**
+ * @brief Logs a block whose header is being written, for the incremental
+ * heap checker. Arena mode always sweeps, and its threads would race on the
+ * log, so nothing is logged there.
+ * @param[in] block
+ */
+static void touch_block(block_t *block) {
+    if (arena_mode) {
+        return;
+    }
+    if (nr_touched >= touch_capacity) {
+        touch_overflow = true;
+        return;
+    }
+    touched[nr_touched++] = block;
+}
+
 /**
  * @brief Writes an header at the given address.
  *
@@ -415,7 +1010,9 @@ static block_t *find_prev_mini(block_t *block) {
 static void write_header(block_t *block, size_t size, bool alloc,
                          bool prev_alloc, bool prev_mini) {
     dbg_requires(block != NULL);
-    block->header = pack(size, alloc, prev_alloc, prev_mini);
+    dbg_requires(size <= max_block_size);
+    dbg_touch(block);
+    block->header = (uint32_t)pack(size, alloc, prev_alloc, prev_mini);
 }
 
 /**
@@ -454,7 +1051,7 @@ static block_t *find_next(block_t *block) {
  */
 static word_t *find_prev_footer(block_t *block) {
     // Compute previous footer position as one word before the header
-    return &(block->header) - 1;
+    return (word_t *)block - 1;
 }
 
 /**
@@ -470,6 +1067,60 @@ static block_t *find_prev(block_t *block) {
     return (block_t *)((char *)block - size);
 }
 
+/**
+ * @brief Finds the arena that owns a block.
+ * @param[in] block A block in the heap
+ * @return The arena whose segments contain the block
+ */
+static arena_t *block_arena(block_t *block) {
+    if (!arena_mode) {
+        return main_arena;
+    }
+    size_t offset = (size_t)((char *)block - (char *)mem_heap_lo());
+    return arenas[arena_map[offset / arena_grain]];
+}
+
+/**
+ * @brief Locks an arena. Only needed when there is more than one arena.
+ * @param[in] arena
+ */
+static void arena_lock(arena_t *arena) {
+    if (arena_mode) {
+        pthread_mutex_lock(&arena->lock);
+    }
+}
+
+/**
+ * @brief Unlocks an arena locked by arena_lock.
+ * @param[in] arena
+ */
+static void arena_unlock(arena_t *arena) {
+    if (arena_mode) {
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * @brief Takes the lock that protects mem_sbrk and the arena table.
+ *
+ * Lock order: an arena lock may be held while taking this one, never the
+ * other way round.
+ */
+static void heap_lock_acquire(void) {
+    if (arena_mode) {
+        pthread_mutex_lock(&heap_lock);
+    }
+}
+
+/**
+ * @brief Releases the lock taken by heap_lock_acquire.
+ */
+static void heap_lock_release(void) {
+    if (arena_mode) {
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
 /*
  * ---------------------------------------------------------------------------
  *                        END SHORT HELPER FUNCTIONS
@@ -482,21 +1133,39 @@ static block_t *find_prev(block_t *block) {
  * @brief
  *
  * @functions: To coalesce the block under different cases
- * @arguments: the block we need to coalesce
+ * @arguments: the arena owning the block; the block we need to coalesce
  * @preconditions: we only call this function when we are freeing a block
+ * @param[in] arena
  * @param[in] block
  * @return the block after coalescing
  */
-static block_t *coalesce_block(block_t *block) {
+static block_t *coalesce_block(arena_t *arena, block_t *block) {
     dbg_requires(!get_alloc(block));
     size_t size = get_size(block);
     block_t *next_block = find_next(block);
-    block_t *prev_block = find_prev(block);
-    if (get_prev_mini(block)) {
-        prev_block = find_prev_mini(block);
-    }
     bool prev_alloc = get_prev_alloc(block);
     bool next_alloc = get_alloc(next_block);
+    // Only look behind the block when it is free: an allocated neighbour's
+    // last word is payload and may belong to another thread
+    block_t *prev_block = NULL;
+    if (!prev_alloc) {
+        prev_block = get_prev_mini(block) ? find_prev_mini(block)
+                                          : find_prev(block);
+    }
+    // A neighbour that would take the block past max_block_size is left
+    // apart, as if it were allocated
+    if (!next_alloc && size + get_size(next_block) > max_block_size) {
+        next_alloc = true;
+    }
+    if (!prev_alloc &&
+        size + get_size(prev_block) +
+                (next_alloc ? 0 : get_size(next_block)) >
+            max_block_size) {
+        prev_alloc = true;
+    }
+    if (!prev_alloc || !next_alloc) {
+        stat_add(&counters.classes[get_index(size)].coalesces, 1);
+    }
 
     // Case 1
     // Previous and next alloc
@@ -506,87 +1175,361 @@ static block_t *coalesce_block(block_t *block) {
         } else {
             set_nextblock_prev_alloc(block, false, false);
         }
-        insert_block(block);
+        insert_block(arena, block);
     }
     // Case 2
     // Previous alloc and next not alloc
     // Coalesce next block
     else if (prev_alloc && !next_alloc) {
-        delete_block(next_block);
+        delete_block(arena, next_block);
         size += get_size(next_block);
+        bool before_alloc = get_prev_alloc(block);
         bool prev_mini = get_prev_mini(block);
-        write_header(block, size, false, true, prev_mini);
-        write_footer(block, size, false, true, prev_mini);
+        write_header(block, size, false, before_alloc, prev_mini);
+        write_footer(block, size, false, before_alloc, prev_mini);
         set_nextblock_prev_alloc(block, false, false);
-        insert_block(block);
+        insert_block(arena, block);
     }
     // Case 3
     // Previous not alloc and next alloc
     // Coalesce previous block
     else if (!prev_alloc && next_alloc) {
-        delete_block(prev_block);
+        delete_block(arena, prev_block);
         size += get_size(prev_block);
-        bool prev_mini = get_prev_mini(block);
-        write_header(prev_block, size, false, true, prev_mini);
-        write_footer(prev_block, size, false, true, prev_mini);
+        bool before_alloc = get_prev_alloc(prev_block);
+        bool prev_mini = get_prev_mini(prev_block);
+        write_header(prev_block, size, false, before_alloc, prev_mini);
+        write_footer(prev_block, size, false, before_alloc, prev_mini);
         set_nextblock_prev_alloc(block, false, false);
         block = prev_block;
-        insert_block(block);
+        insert_block(arena, block);
     }
     // Case 4
     // Coalesce both previous and next
     else {
-        delete_block(prev_block);
-        delete_block(next_block);
+        delete_block(arena, prev_block);
+        delete_block(arena, next_block);
         size += get_size(prev_block);
         size += get_size(next_block);
+        bool before_alloc = get_prev_alloc(prev_block);
         bool prev_mini = get_prev_mini(prev_block);
-        write_header(prev_block, size, false, true, prev_mini);
-        write_footer(prev_block, size, false, true, prev_mini);
+        write_header(prev_block, size, false, before_alloc, prev_mini);
+        write_footer(prev_block, size, false, before_alloc, prev_mini);
         set_nextblock_prev_alloc(prev_block, false, false);
         block = prev_block;
-        insert_block(block);
+        insert_block(arena, block);
     }
-    // insert_block(block);
     dbg_ensures(!get_alloc(block));
-    dbg_requires(mm_checkheap(__LINE__));
+    dbg_requires(check_arena_step(arena, __LINE__));
     return block;
 }
 
 /**
  * @brief
  *
- * @functions: extend the heap when the space is limited or when we found the
- * heap
- * @arguments: how many size we need to extend
- * @preconditions: the size we extend should be the multiple of dsize
+ * @functions: get memory from mem_sbrk on behalf of an arena. In arena mode
+ * the request is rounded up so that the break stays on a granule boundary,
+ * and the new granules are recorded as owned by the arena
+ * @arguments: the id of the arena, how many bytes it needs, where to store the
+ * number of bytes actually obtained
+ * @preconditions: the heap lock is held in arena mode
+ * @param[in] id
  * @param[in] size
- * @return the new block after extending
+ * @param[out] got
+ * @return the start of the new memory, NULL if the heap is exhausted
  */
-static block_t *extend_heap(size_t size) {
-    void *bp;
+static char *heap_sbrk(size_t id, size_t size, size_t *got) {
+    if (!arena_mode) {
+        void *bp = mem_sbrk(size);
+        if (bp == (void *)-1) {
+            return NULL;
+        }
+        *got = size;
+        return (char *)bp;
+    }
 
-    // Allocate an even number of words to maintain alignment
+    char *lo = (char *)mem_heap_lo();
+    size_t start = (size_t)((char *)mem_heap_hi() + 1 - lo);
+    size_t end = round_up(start + size, arena_grain);
+    if (end / arena_grain > arena_map_size) {
+        return NULL;
+    }
+    void *bp = mem_sbrk(end - start);
+    if (bp == (void *)-1) {
+        return NULL;
+    }
+    for (size_t g = start / arena_grain; g < end / arena_grain; g++) {
+        arena_map[g] = (uint8_t)id;
+    }
+    *got = end - start;
+    return (char *)bp;
+}
+
+/**
+ * @brief
+ *
+ * @functions: turn memory that does not follow the newest segment of the arena
+ * into a new segment: prologue, one free block and the epilogue
+ * @arguments: the arena, the start of the memory and its size
+ * @preconditions: size is a multiple of dsize, larger than segment_overhead
+ * @param[in] arena
+ * @param[in] start
+ * @param[in] size
+ * @return the free block of the new segment, not yet in any free list
+ */
+static block_t *add_segment(arena_t *arena, char *start, size_t size) {
+    dbg_requires(size >= segment_overhead + min_block_size);
+    segment_t *segment = (segment_t *)start;
+    segment->next = arena->segments;
+    segment->unused = 0;
+    segment->prologue = pack(0, true, true, false);
+    arena->segments = segment;
+
+    size_t block_size = size - segment_overhead;
+    block_t *block = (block_t *)(start + sizeof(segment_t));
+    write_header(block, block_size, false, true, false);
+    write_footer(block, block_size, false, true, false);
+
+    // Epilogue header
+    write_header(find_next(block), 0, true, false,
+                 block_size == min_block_size);
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * @functions: extend the heap when the space is limited or when we found the
+ * heap
+ * @arguments: the arena to extend; how many size we need to extend
+ * @preconditions: the size we extend should be the multiple of dsize
+ * @param[in] arena
+ * @param[in] size
+ * @return the new block after extending
+ */
+static block_t *extend_heap(arena_t *arena, size_t size) {
+    char *bp;
+    size_t got;
+
+    // Allocate an even number of words to maintain alignment. In arena mode
+    // other arenas may have moved the break, so leave room for a new segment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
+    heap_lock_acquire();
+    if ((char *)mem_heap_hi() + 1 != arena->seg_end) {
+        size += segment_overhead;
+    }
+    bp = heap_sbrk(arena->id, size, &got);
+    heap_lock_release();
+    if (bp == NULL) {
         return NULL;
     }
+    stat_add(&counters.extends, 1);
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
+    block_t *block;
+    if (bp == arena->seg_end) {
+        // The old epilogue becomes the header of the new free block
+        block = payload_to_header(bp);
+        bool prev_alloc = get_prev_alloc(block);
+        bool prev_mini = get_prev_mini(block);
+        write_header(block, got, false, prev_alloc, prev_mini);
+        write_footer(block, got, false, prev_alloc, prev_mini);
+
+        // Create new epilogue header
+        block_t *next_block = find_next(block);
+        write_header(next_block, 0, true, false, false);
+    } else {
+        block = add_segment(arena, bp, got);
+    }
+    arena->seg_end = bp + got;
+
+    // Coalesce in case the previous block was free
+    block = coalesce_block(arena, block);
+    dbg_requires(check_arena_step(arena, __LINE__));
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * @functions: give the end of the heap back with a negative mem_sbrk when the
+ * free block before the epilogue reaches trim_threshold. The block keeps
+ * chunksize bytes (in arena mode, up to the next granule boundary, so that
+ * the break stays on one)
+ * @arguments: the arena owning the block; the coalesced free block
+ * @preconditions: the block is free and in the free lists
+ * @param[in] arena
+ * @param[in] block
+ */
+static void trim_heap(arena_t *arena, block_t *block) {
+    // Only the last block of the newest segment ends at the break
+    size_t size = get_size(block);
+    block_t *next = find_next(block);
+    if (get_size(next) != 0 || (char *)next + wsize != arena->seg_end) {
+        return;
+    }
+    // As much free memory at the end as one extension: growth has stopped
+    if (size >= arena->grow) {
+        arena->grow = max(chunksize, arena->grow / 2);
+    }
+    if (trim_threshold == 0 || size < trim_threshold) {
+        return;
+    }
+
+    char *end = (char *)block + chunksize + wsize;
+    if (arena_mode) {
+        char *lo = (char *)mem_heap_lo();
+        end = lo + round_up((size_t)(end - lo), arena_grain);
+    }
+    if (end >= arena->seg_end) {
+        return;
+    }
+
+    heap_lock_acquire();
+    // Another arena may have extended the heap past this segment
+    if (arena->seg_end != (char *)mem_heap_hi() + 1 ||
+        mem_sbrk(-(intptr_t)(arena->seg_end - end)) == (void *)-1) {
+        heap_lock_release();
+        return;
+    }
+    heap_lock_release();
+    stat_add(&counters.trims, 1);
+
+    // Shrink the block and write the new epilogue at the new break
+    delete_block(arena, block);
+    size = (size_t)(end - wsize - (char *)block);
     bool prev_alloc = get_prev_alloc(block);
     bool prev_mini = get_prev_mini(block);
-    // bool next_alloc = get_next_alloc(block);
     write_header(block, size, false, prev_alloc, prev_mini);
     write_footer(block, size, false, prev_alloc, prev_mini);
+    write_header(find_next(block), 0, true, false, false);
+    arena->seg_end = end;
+    // A free predecessor left apart at max_block_size may fit now
+    coalesce_block(arena, block);
+}
 
-    // Create new epilogue header
-    block_t *next_block = find_next(block);
-    write_header(next_block, 0, true, false, false);
+/**
+ * @brief
+ *
+ * @functions: choose how much to extend the heap by for a request that found
+ * no fit. Each extension doubles the next one, so a phase of sustained growth
+ * calls mem_sbrk a logarithmic number of times, up to grow_limit and to a
+ * fraction of the heap size. trim_heap halves it again when free memory piles
+ * up at the end of the heap
+ * @arguments: the arena to extend; the adjusted size of the request
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] asize
+ * @return the number of bytes to extend the heap by
+ */
+static size_t extend_size(arena_t *arena, size_t asize) {
+    size_t size = max(asize, arena->grow);
+    size_t limit = max(chunksize, mem_heapsize() >> grow_shift);
+    arena->grow = max(chunksize, min(2 * arena->grow, min(limit, grow_limit)));
+    return size;
+}
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
-    dbg_requires(mm_checkheap(__LINE__));
+/**
+ * @brief
+ *
+ * @functions: find a free block of at least asize bytes in the arena. When
+ * there is none, the unsorted bin is consolidated, then the thread cache is
+ * given back (its blocks may coalesce into a fit), and only then is the heap
+ * extended
+ * @arguments: the arena; the adjusted size needed
+ * @preconditions: the arena is locked; it is unlocked for a while to flush
+ * the thread cache
+ * @param[in] arena
+ * @param[in] asize
+ * @return a free block of at least asize bytes, NULL if the heap is exhausted
+ */
+static block_t *obtain_block(arena_t *arena, size_t asize) {
+    // Search the free list for a fit
+    block_t *block = find_fit(arena, asize);
+
+    // Merge the parked blocks, they may make a fit
+    if (block == NULL && consolidate(arena)) {
+        block = find_fit(arena, asize);
+    }
+
+    // Before growing the heap, give the cached blocks back and search again
+    if (block == NULL) {
+        arena_unlock(arena);
+        bool released = tcache_flush();
+        arena_lock(arena);
+        if (released) {
+            consolidate(arena);
+            block = find_fit(arena, asize);
+        }
+    }
+
+    // If no fit is found, request more memory
+    if (block == NULL) {
+        // Request at least the arena's current extension size
+        block = extend_heap(arena, extend_size(arena, asize));
+    }
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * @functions: allocate asize bytes of a free block at the first place where
+ * the payload is a multiple of align. The bytes skipped in front and the ones
+ * left after become free blocks of their own
+ * @arguments: the arena owning the block; the free block; the size to
+ * allocate and the alignment of the payload
+ * @preconditions: the block is free, at least asize + align - dsize bytes
+ * large; align is a power of 2, at least dsize
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] asize
+ * @param[in] align
+ * @return the allocated block, whose payload is aligned
+ */
+static block_t *carve_aligned(arena_t *arena, block_t *block, size_t asize,
+                              size_t align) {
+    dbg_requires(!get_alloc(block));
+    size_t size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+    delete_block(arena, block);
+
+    // The skipped bytes are a multiple of dsize, so never a partial block
+    uintptr_t payload = (uintptr_t)header_to_payload(block);
+    size_t lead = round_up(payload, align) - payload;
+    dbg_assert(size >= lead + asize);
+    if (lead != 0) {
+        write_header(block, lead, false, prev_alloc, prev_mini);
+        if (lead != min_block_size) {
+            write_footer(block, lead, false, prev_alloc, prev_mini);
+        }
+        // Claim the rest first, so the lead may merge with a free block
+        // before it that was left apart at max_block_size
+        block_t *lead_block = block;
+        block = find_next(block);
+        size -= lead;
+        write_header(block, size, true, false, lead == min_block_size);
+        set_nextblock_prev_alloc(block, true, size == min_block_size);
+        coalesce_block(arena, lead_block);
+        prev_alloc = false;
+        prev_mini = get_prev_mini(block);
+    }
+
+    if (size - asize >= min_block_size) {
+        stat_add(&counters.classes[get_index(asize)].splits, 1);
+        write_header(block, asize, true, prev_alloc, prev_mini);
+        block_t *tail = find_next(block);
+        size_t tail_size = size - asize;
+        write_header(tail, tail_size, false, true, asize == min_block_size);
+        if (tail_size != min_block_size) {
+            write_footer(tail, tail_size, false, true,
+                         asize == min_block_size);
+        }
+        coalesce_block(arena, tail);
+    } else {
+        write_header(block, size, true, prev_alloc, prev_mini);
+        set_nextblock_prev_alloc(block, true, size == min_block_size);
+    }
     return block;
 }
 
@@ -594,24 +1537,28 @@ static block_t *extend_heap(size_t size) {
  * @brief
  *
  * @functions: after mallocing the block we need to split the free block
- * @arguments: the block we split and how many sizes it is
+ * @arguments: the arena owning the block; the block we split and how many
+ * sizes it is
  * @return NULL
  * @preconditions: the left space is bigger than or equal to the size we need
+ * @param[in] arena
  * @param[in] block
  * @param[in] asize
  */
-static void split_block(block_t *block, size_t asize) {
+static void split_block(arena_t *arena, block_t *block, size_t asize) {
     dbg_requires(!get_alloc(block));
     /* TODO: Can you write a precondition about the value of asize? */
 
     size_t block_size = get_size(block);
 
-    delete_block(block);
+    delete_block(arena, block);
 
     if ((block_size - asize) >= min_block_size) {
+        stat_add(&counters.classes[get_index(asize)].splits, 1);
+        bool prev_alloc = get_prev_alloc(block);
         bool prev_mini = get_prev_mini(block);
-        write_header(block, asize, true, true, prev_mini);
-        write_footer(block, asize, true, true, prev_mini);
+        write_header(block, asize, true, prev_alloc, prev_mini);
+        write_footer(block, asize, true, prev_alloc, prev_mini);
 
         bool next_prev_mini;
         if (block_size == min_block_size) {
@@ -625,18 +1572,13 @@ static void split_block(block_t *block, size_t asize) {
         write_footer(next_block, block_size - asize, false, true,
                      next_prev_mini);
 
-        bool next_next_prev_mini;
-        if (block_size - asize == min_block_size) {
-            next_next_prev_mini = true;
-        } else {
-            next_next_prev_mini = false;
-        }
-        // block_t *next_next_block = find_next(next_block);
-        set_nextblock_prev_alloc(next_block, false, next_next_prev_mini);
-        insert_block(next_block);
+        // The block may have been left apart from a free successor that
+        // would have taken it past max_block_size; the remainder may fit
+        coalesce_block(arena, next_block);
     } else {
         bool prev_mini = get_prev_mini(block);
-        write_header(block, block_size, true, true, prev_mini);
+        write_header(block, block_size, true, get_prev_alloc(block),
+                     prev_mini);
 
         block_t *next_block = find_next(block);
         bool temp_mini = get_prev_mini(next_block);
@@ -646,21 +1588,367 @@ static void split_block(block_t *block, size_t asize) {
     dbg_ensures(get_alloc(block));
 }
 
+/**
+ * @brief
+ *
+ * @functions: cut count allocated blocks of asize bytes back to back out of a
+ * free block, which leaves the free lists once, and give the rest back
+ * @arguments: the arena owning the block; the free block; the size and number
+ * of the blocks to allocate
+ * @preconditions: the block is free, at least asize * count bytes large,
+ * count is at least 1
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] asize
+ * @param[in] count
+ */
+static void split_batch(arena_t *arena, block_t *block, size_t asize,
+                        size_t count) {
+    dbg_requires(!get_alloc(block) && count >= 1);
+    dbg_requires(get_size(block) / asize >= count);
+    size_t size = get_size(block);
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+    delete_block(arena, block);
+
+    for (size_t i = 1; i < count; i++) {
+        write_header(block, asize, true, prev_alloc, prev_mini);
+        block = find_next(block);
+        size -= asize;
+        prev_alloc = true;
+        prev_mini = (asize == min_block_size);
+    }
+
+    // The last block keeps a tail too small to be a block of its own
+    if (size - asize >= min_block_size) {
+        stat_add(&counters.classes[get_index(asize)].splits, 1);
+        write_header(block, asize, true, prev_alloc, prev_mini);
+        block_t *tail = find_next(block);
+        size_t tail_size = size - asize;
+        write_header(tail, tail_size, false, true, asize == min_block_size);
+        if (tail_size != min_block_size) {
+            write_footer(tail, tail_size, false, true,
+                         asize == min_block_size);
+        }
+        coalesce_block(arena, tail);
+    } else {
+        write_header(block, size, true, prev_alloc, prev_mini);
+        set_nextblock_prev_alloc(block, true, size == min_block_size);
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: give the tail of an allocated block back to the free lists, so
+ * that the block keeps asize bytes
+ * @arguments: the arena owning the block; the block and the size it keeps
+ * @preconditions: the block is allocated, at least asize bytes large, and the
+ * block after it records it as allocated
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] asize
+ */
+static void trim_block(arena_t *arena, block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block) && get_size(block) >= asize);
+    size_t tail_size = get_size(block) - asize;
+    if (tail_size < min_block_size) {
+        return;
+    }
+    stat_add(&counters.classes[get_index(asize)].splits, 1);
+
+    write_header(block, asize, true, get_prev_alloc(block),
+                 get_prev_mini(block));
+    block_t *tail = find_next(block);
+    write_header(tail, tail_size, false, true, asize == min_block_size);
+    if (tail_size != min_block_size) {
+        write_footer(tail, tail_size, false, true, asize == min_block_size);
+    }
+    set_nextblock_prev_alloc(tail, false, tail_size == min_block_size);
+    trim_heap(arena, coalesce_block(arena, tail));
+}
+
+/**
+ * @brief
+ *
+ * @functions: resize an allocated block without moving it. A shrinking block
+ * gives its tail back; a growing block absorbs the free block after it and,
+ * when it is the last block of the arena, the memory past the epilogue
+ * @arguments: the arena owning the block; the block and its new size
+ * @preconditions: the block is allocated, asize is a multiple of dsize
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] asize
+ * @return true if the block now has at least asize bytes, false if it must move
+ */
+static bool resize_block(arena_t *arena, block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    if (asize <= size) {
+        trim_block(arena, block, asize);
+        return true;
+    }
+    if (asize >= huge_size) {
+        return false;
+    }
+
+    block_t *next = find_next(block);
+    block_t *after = next;
+    if (!get_alloc(next)) {
+        size += get_size(next);
+        after = find_next(next);
+    }
+    if (size < asize) {
+        // Only the last block of the newest segment can grow into new memory
+        if (get_size(after) != 0 || (char *)after + wsize != arena->seg_end) {
+            return false;
+        }
+        if (extend_heap(arena, max(asize - size, chunksize)) == NULL) {
+            return false;
+        }
+        // In arena mode the new memory may have become a separate segment
+        next = find_next(block);
+        if (get_alloc(next) || get_size(block) + get_size(next) < asize) {
+            return false;
+        }
+    }
+    if (get_size(block) + get_size(next) > max_block_size) {
+        return false;
+    }
+
+    size = get_size(block) + get_size(next);
+    delete_block(arena, next);
+    write_header(block, size, true, get_prev_alloc(block),
+                 get_prev_mini(block));
+    set_nextblock_prev_alloc(block, true, false);
+    trim_block(arena, block, asize);
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: order of the large block tree: by size, then by address
+ * @arguments: two free blocks
+ * @preconditions: NULL
+ * @param[in] a
+ * @param[in] b
+ * @return true if a comes before b
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/**
+ * @brief
+ *
+ * @functions: put v in the place of u under u's parent (or at the root)
+ * @arguments: the arena of the tree; the node to replace; its replacement
+ * @preconditions: NULL
+ * @param[in] arena
+ * @param[in] u
+ * @param[in] v
+ */
+static void tree_replace(arena_t *arena, block_t *u, block_t *v) {
+    block_t *parent = u->info.tree_node.parent;
+    if (parent == NULL) {
+        arena->seg_list[list_number - 1] = v;
+    } else if (u == parent->info.tree_node.left) {
+        parent->info.tree_node.left = v;
+    } else {
+        parent->info.tree_node.right = v;
+    }
+    if (v != NULL) {
+        v->info.tree_node.parent = parent;
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: rotate x down to the left, its right child takes its place
+ * @arguments: the arena of the tree; the node to rotate
+ * @preconditions: x has a right child
+ * @param[in] arena
+ * @param[in] x
+ */
+static void tree_rotate_left(arena_t *arena, block_t *x) {
+    block_t *y = x->info.tree_node.right;
+    x->info.tree_node.right = y->info.tree_node.left;
+    if (y->info.tree_node.left != NULL) {
+        y->info.tree_node.left->info.tree_node.parent = x;
+    }
+    tree_replace(arena, x, y);
+    y->info.tree_node.left = x;
+    x->info.tree_node.parent = y;
+}
+
+/**
+ * @brief
+ *
+ * @functions: rotate x down to the right, its left child takes its place
+ * @arguments: the arena of the tree; the node to rotate
+ * @preconditions: x has a left child
+ * @param[in] arena
+ * @param[in] x
+ */
+static void tree_rotate_right(arena_t *arena, block_t *x) {
+    block_t *y = x->info.tree_node.left;
+    x->info.tree_node.left = y->info.tree_node.right;
+    if (y->info.tree_node.right != NULL) {
+        y->info.tree_node.right->info.tree_node.parent = x;
+    }
+    tree_replace(arena, x, y);
+    y->info.tree_node.right = x;
+    x->info.tree_node.parent = y;
+}
+
+/**
+ * @brief
+ *
+ * @functions: move x to the root of the tree with zig, zig-zig and zig-zag
+ * steps, as in stree.c, which keeps the operations O(log n) amortized
+ * @arguments: the arena of the tree; the node to splay
+ * @preconditions: x is in the tree
+ * @param[in] arena
+ * @param[in] x
+ */
+static void tree_splay(arena_t *arena, block_t *x) {
+    while (x->info.tree_node.parent != NULL) {
+        block_t *p = x->info.tree_node.parent;
+        block_t *g = p->info.tree_node.parent;
+        bool x_left = (p->info.tree_node.left == x);
+        if (g == NULL) {
+            if (x_left) {
+                tree_rotate_right(arena, p);
+            } else {
+                tree_rotate_left(arena, p);
+            }
+        } else if (x_left && g->info.tree_node.left == p) {
+            tree_rotate_right(arena, g);
+            tree_rotate_right(arena, p);
+        } else if (!x_left && g->info.tree_node.right == p) {
+            tree_rotate_left(arena, g);
+            tree_rotate_left(arena, p);
+        } else if (x_left) {
+            tree_rotate_right(arena, p);
+            tree_rotate_left(arena, g);
+        } else {
+            tree_rotate_left(arena, p);
+            tree_rotate_right(arena, g);
+        }
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: insert a free block of the largest class into the tree. The
+ * node links are stored in the payload of the block
+ * @arguments: the arena owning the block; the block
+ * @preconditions: the block is free and not in the tree
+ * @param[in] arena
+ * @param[in] block
+ */
+static void tree_insert(arena_t *arena, block_t *block) {
+    block_t *parent = NULL;
+    block_t *node = arena->seg_list[list_number - 1];
+    while (node != NULL) {
+        parent = node;
+        node = tree_less(block, node) ? node->info.tree_node.left
+                                      : node->info.tree_node.right;
+    }
+
+    block->info.tree_node.left = NULL;
+    block->info.tree_node.right = NULL;
+    block->info.tree_node.parent = parent;
+    if (parent == NULL) {
+        arena->seg_list[list_number - 1] = block;
+    } else if (tree_less(block, parent)) {
+        parent->info.tree_node.left = block;
+    } else {
+        parent->info.tree_node.right = block;
+    }
+    tree_splay(arena, block);
+}
+
+/**
+ * @brief
+ *
+ * @functions: remove a block from the tree, splaying it to the root first
+ * @arguments: the arena owning the block; the block
+ * @preconditions: the block is in the tree
+ * @param[in] arena
+ * @param[in] block
+ */
+static void tree_remove(arena_t *arena, block_t *block) {
+    tree_splay(arena, block);
+    block_t *left = block->info.tree_node.left;
+    block_t *right = block->info.tree_node.right;
+    if (left == NULL) {
+        tree_replace(arena, block, right);
+    } else if (right == NULL) {
+        tree_replace(arena, block, left);
+    } else {
+        // the successor takes the place of the block
+        block_t *next = right;
+        while (next->info.tree_node.left != NULL) {
+            next = next->info.tree_node.left;
+        }
+        if (next != right) {
+            tree_replace(arena, next, next->info.tree_node.right);
+            next->info.tree_node.right = right;
+            right->info.tree_node.parent = next;
+        }
+        tree_replace(arena, block, next);
+        next->info.tree_node.left = left;
+        left->info.tree_node.parent = next;
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: find the best fit for a large request: the smallest block of at
+ * least asize bytes, the lowest one in the heap among equal sizes
+ * @arguments: the arena to search; the size of the block
+ * @preconditions: asize should be the multiple of dsize
+ * @param[in] arena
+ * @param[in] asize
+ * @return the block, NULL if no block in the tree is large enough
+ */
+static block_t *tree_find_fit(arena_t *arena, size_t asize) {
+    block_t *best_fit = NULL;
+    block_t *node = arena->seg_list[list_number - 1];
+    while (node != NULL) {
+        stat_add(&counters.classes[get_index(asize)].fit_probes, 1);
+        if (get_size(node) >= asize) {
+            best_fit = node;
+            node = node->info.tree_node.left;
+        } else {
+            node = node->info.tree_node.right;
+        }
+    }
+    if (best_fit != NULL) {
+        tree_splay(arena, best_fit);
+    }
+    return best_fit;
+}
+
 /**
  * @brief
  *
  * @functions: delete the block in the heap and change the pointer in block
- * @arguments: the block we need to delete
+ * @arguments: the arena owning the block; the block we need to delete
  * @preconditions: NULL
- * @param[in] size
+ * @param[in] arena
+ * @param[in] block
  * @return NULL
  */
 
-static void delete_block(block_t *block) {
-    // printf("jinru\n");
-
+static void delete_block(arena_t *arena, block_t *block) {
     if (block == NULL) {
-        // printf("null");
         return;
     }
 
@@ -668,11 +1956,20 @@ static void delete_block(block_t *block) {
     size_t index = get_index(asize);
     size_t size = get_size(block);
 
+    if (index == list_number - 1) {
+        tree_remove(arena, block);
+        if (arena->seg_list[index] == NULL) {
+            arena->list_map &= ~((uint64_t)1 << index);
+        }
+        return;
+    }
+
     if (size != min_block_size) {
         // no block in this list
         // prev null next null
         if (!block->info.free_block.prev && !block->info.free_block.next) {
-            seg_list[index] = NULL;
+            arena->seg_list[index] = NULL;
+            arena->list_map &= ~((uint64_t)1 << index);
             return;
         }
         // the first block
@@ -681,7 +1978,7 @@ static void delete_block(block_t *block) {
                  !!(block->info.free_block.next)) {
             block_t *next_block = block->info.free_block.next;
             next_block->info.free_block.prev = NULL;
-            seg_list[index] = next_block;
+            arena->seg_list[index] = next_block;
             return;
         }
         // the last block
@@ -697,17 +1994,13 @@ static void delete_block(block_t *block) {
         else {
             block_t *next_block = block->info.free_block.next;
             block_t *prev_block = block->info.free_block.prev;
-            times++;
-            // printf("times = %zu\n", times);
-            // printf("prev_block = %p\n", prev_block);
-            // printf("next_block = %p\n", next_block);
             prev_block->info.free_block.next = next_block;
             next_block->info.free_block.prev = prev_block;
             return;
         }
     } else {
         block_t *prevpoint = NULL;
-        for (block_t *temp = seg_list[index]; temp != block;
+        for (block_t *temp = arena->seg_list[index]; temp != block;
              temp = temp->info.free_block.next) {
             prevpoint = temp;
         }
@@ -715,7 +2008,10 @@ static void delete_block(block_t *block) {
         if (prevpoint != NULL) {
             prevpoint->info.free_block.next = nextptr;
         } else {
-            seg_list[index] = nextptr;
+            arena->seg_list[index] = nextptr;
+            if (nextptr == NULL) {
+                arena->list_map &= ~((uint64_t)1 << index);
+            }
         }
         return;
     }
@@ -725,20 +2021,28 @@ static void delete_block(block_t *block) {
  * @brief
  *
  * @functions: insert the free block into segregate list, implementing with LIFO
- * @arguments: the block we need to insert
+ * @arguments: the arena owning the block; the block we need to insert
  * @preconditions: NULL
- * @param[in] size
+ * @param[in] arena
+ * @param[in] block
  * @return NULL
  */
-static void insert_block(block_t *block) {
+static void insert_block(arena_t *arena, block_t *block) {
     if (!block) {
         return;
     }
     size_t asize = round_up(get_size(block), dsize);
     size_t index = get_index(asize);
+    // the largest class is a tree
+    if (index == list_number - 1) {
+        tree_insert(arena, block);
+        arena->list_map |= (uint64_t)1 << index;
+        return;
+    }
     // if it is the first block in this list
-    if (!seg_list[index]) {
-        seg_list[index] = block;
+    if (!arena->seg_list[index]) {
+        arena->seg_list[index] = block;
+        arena->list_map |= (uint64_t)1 << index;
         size_t size = get_size(block);
         if (size != min_block_size) {
             block->info.free_block.prev = NULL;
@@ -748,13 +2052,13 @@ static void insert_block(block_t *block) {
     // LIFO
     else {
         size_t size = get_size(block);
-        block_t *first_block = seg_list[index];
+        block_t *first_block = arena->seg_list[index];
         block->info.free_block.next = first_block;
         if (size != min_block_size) {
             block->info.free_block.prev = NULL;
             first_block->info.free_block.prev = block;
         }
-        seg_list[index] = block;
+        arena->seg_list[index] = block;
     }
     return;
 }
@@ -763,61 +2067,74 @@ static void insert_block(block_t *block) {
  * @brief
  *
  * @functions: to get the index in the segregate list to find which position to
- * store the free block. It looks like the hashcode in JAVA
+ * store the free block. Small sizes map directly to their class; larger ones
+ * are classified by their highest bit and the class_bits bits below it, so
+ * there is no loop over the classes
  * @arguments: the size of the free block
- * @preconditions: segregate list is the global variable
- * @param[in] size
+ * @preconditions: asize is a multiple of dsize
+ * @param[in] asize
  * @return the index of the position in the segregate list
- * @idea: Get the idea from website:
- *        https://www.cnblogs.com/xiekeli/archive/2012/01/13/2321207.html
  */
 static size_t get_index(size_t asize) {
-    // if size smaller than double size, return 0
+    // the mini blocks have their own list
     if (asize <= min_block_size) {
         return 0;
-
     }
-    // if the size larger than the bigger one, return list_number - 1
-    else if (asize >= (dsize << ((list_number - 2) * (list_index)))) {
-        return (list_number - 1);
-
+    if (asize < small_class_limit) {
+        return asize / dsize - 1;
     }
-    // Normal
-    else {
-        for (size_t j = 1; j < list_number - 1; j++) {
-            if (asize >= (dsize << (j * list_index - list_index)) &&
-                (asize < dsize << (j * list_index)))
-                return j;
-        }
+
+    // small_class_limit is 1 << 6, which starts the first group of classes
+    size_t msb = (size_t)(63 - __builtin_clzll((unsigned long long)asize));
+    size_t sub = (asize >> (msb - class_bits)) & ((1 << class_bits) - 1);
+    size_t index = (small_class_limit / dsize - 1) +
+                   ((msb - 6) << class_bits) + sub;
+    if (index >= list_number) {
+        return list_number - 1;
     }
-    // Default
-    return 0;
+    return index;
 }
 
 /**
  * @brief
  *
- * @functions: find_fit to find the suitable free block to alloc
- * @arguments: the size of the block
+ * @functions: find_fit to find the suitable free block to alloc. It returns
+ * the best fit of the first non-empty list that has one, or the best of the
+ * first fit_depth fitting blocks when fit_depth is set
+ * @arguments: the arena to search; the size of the block
  * @precondition: asize should be the multiple of dsize
+ * @param[in] arena
  * @param[in] asize
  * @return the block of the suitable space
  */
-static block_t *find_fit(size_t asize) {
+static block_t *find_fit(arena_t *arena, size_t asize) {
     // find the corresponding index for the block in our list array according
     // to its size
     size_t index = 0;
     index = get_index(asize);
+    mm_class_stats_t *class_stats = &counters.classes[index];
+    stat_add(&class_stats->fit_calls, 1);
     // pointer pointing at the best fit block
     block_t *best_fit = NULL;
     block_t *block;
     // assign a big number
     size_t best_fit_num = UINT64_MAX;
+    // number of fitting blocks seen so far
+    size_t candidates = 0;
+
+    // only visit the lists that are not empty, starting from index
+    uint64_t map = arena->list_map & ~(((uint64_t)1 << index) - 1);
 
     // loop through all the blocks in lists to find the best fit block
-    for (; index < list_number; index++) {
-        block = seg_list[index];
+    for (; map != 0; map &= map - 1) {
+        index = (size_t)__builtin_ctzll(map);
+        // the largest class is a tree that gives the best fit directly
+        if (index == list_number - 1) {
+            return tree_find_fit(arena, asize);
+        }
+        block = arena->seg_list[index];
         while (block) {
+            stat_add(&class_stats->fit_probes, 1);
             if (!(get_alloc(block)) && (asize <= get_size(block))) {
                 size_t diff = get_size(block) - asize;
                 // when the size difference is zero, return the block pointer
@@ -828,6 +2145,10 @@ static block_t *find_fit(size_t asize) {
                     best_fit_num = diff;
                     best_fit = block;
                 }
+                // good enough: stop after fit_depth candidates
+                if (++candidates == fit_depth) {
+                    return best_fit;
+                }
             }
             block = block->info.free_block.next;
         }
@@ -856,7 +2177,7 @@ bool check_block(block_t *bp, int line) {
         printf("Alignment Wrong at %d\n", line);
         return false;
     }
-    if ((bp >= heap_start + 2 * dsize) && (get_size(bp) < min_block_size)) {
+    if ((get_size(bp) != 0) && (get_size(bp) < min_block_size)) {
         printf("---------------------\n");
         printf("Size is too small at %d\n", line);
         return false;
@@ -916,42 +2237,110 @@ bool check_boundry(void *p1, void *p2, int line) {
 /**
  * @brief
  *
- * @functions: check the free list: boundry, seglist match
- * @arguments: the number of the block in heap; the number of line in our code
+ * @functions: check a subtree of the large block tree in order: parent links,
+ * ordering, size class and allocation status of every node
+ * @arguments: the subtree; its parent; the last node visited; where to add the
+ * number of nodes; the number of line in our code
  * @preconditions: NULL
+ * @param[in] node
+ * @param[in] parent
+ * @param[in,out] prev
+ * @param[out] number
  * @param[in] line
  * @return false if error occurs; otherwise true
  */
-bool check_freelist(size_t number, int line) {
+static bool check_tree(block_t *node, block_t *parent, block_t **prev,
+                       size_t *number, int line) {
+    if (node == NULL) {
+        return true;
+    }
+    if (node->info.tree_node.parent != parent) {
+        printf("---------------------\n");
+        printf("Tree parent link wrong at %d\n", line);
+        return false;
+    }
+    if (!check_tree(node->info.tree_node.left, node, prev, number, line)) {
+        return false;
+    }
+    if (!check_boundry(node, node, line) || get_alloc(node) ||
+        get_index(get_size(node)) != list_number - 1) {
+        printf("---------------------\n");
+        printf("Bad block in tree at %d\n", line);
+        return false;
+    }
+    if (*prev != NULL && !tree_less(*prev, node)) {
+        printf("---------------------\n");
+        printf("Tree out of order at %d\n", line);
+        return false;
+    }
+    *prev = node;
+    (*number)++;
+    return check_tree(node->info.tree_node.right, node, prev, number, line);
+}
+
+/**
+ * @brief
+ *
+ * @functions: check the free list: boundry, seglist match, list map, and
+ * the tree of the largest class
+ * @arguments: the arena whose lists we check; the number of the free block in
+ * heap; the number of line in our code
+ * @preconditions: NULL
+ * @param[in] arena
+ * @param[in] number
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+bool check_freelist(arena_t *arena, size_t number, int line) {
     block_t *block;
     size_t temp_number = 0;
     for (size_t index = 0; index < list_number; index++) {
-        block = seg_list[index];
-        while (block != NULL) {
-            if (block->info.free_block.next !=
-                block->info.free_block.next->info.free_block.prev) {
+        bool in_map = (arena->list_map >> index) & 1;
+        if (in_map != (arena->seg_list[index] != NULL)) {
+            printf("---------------------\n");
+            printf("List map doesn't match seglist %zu at %d\n", index, line);
+            return false;
+        }
+        if (index == list_number - 1) {
+            block_t *prev = NULL;
+            if (!check_tree(arena->seg_list[index], NULL, &prev, &temp_number,
+                            line)) {
+                return false;
+            }
+            continue;
+        }
+        for (block = arena->seg_list[index]; block != NULL;
+             block = block->info.free_block.next) {
+            block_t *next = block->info.free_block.next;
+            // the mini list (index 0) is singly linked
+            if (index != 0 && next != NULL &&
+                next->info.free_block.prev != block) {
                 printf("---------------------\n");
                 printf("Next or Prev inconsistent at %d\n", line);
                 return false;
-                if (!check_boundry(block->info.free_block.next,
-                                   block->info.free_block.prev, line)) {
-                    printf("---------------------\n");
-                    printf("Pointers Boundry leaks at %d\n", line);
-                    return false;
-                }
-                temp_number++;
-                if (get_index(get_size(block)) != index) {
-                    printf("---------------------\n");
-                    printf("Seglist Size don't match at %d\n", line);
-                    return false;
-                }
-                block = block->info.free_block.next;
             }
+            if (!check_boundry(block, block, line)) {
+                printf("---------------------\n");
+                printf("Pointers Boundry leaks at %d\n", line);
+                return false;
+            }
+            if (get_alloc(block)) {
+                printf("---------------------\n");
+                printf("Allocated block in free list at %d\n", line);
+                return false;
+            }
+            if (get_index(get_size(block)) != index) {
+                printf("---------------------\n");
+                printf("Seglist Size don't match at %d\n", line);
+                return false;
+            }
+            temp_number++;
         }
     }
     if (temp_number != number) {
         printf("---------------------\n");
         printf("Count and Traversing don't match at %d\n", line);
+        return false;
     }
     return true;
 }
@@ -959,57 +2348,18 @@ bool check_freelist(size_t number, int line) {
 /**
  * @brief
  *
- * @functions: check the prologue, block, coalesce, epilogue and boundry of the
- * heap
- * @arguments: the number of the line in code
+ * @functions: check one segment of an arena: prologue, blocks, coalescing
+ * and epilogue
+ * @arguments: the segment; where to add the number of free blocks found
  * @preconditions: NULL
- * @param[in] line
+ * @param[in] segment
+ * @param[out] free_number
  * @return false if error occurs; otherwise true
  */
-// bool mm_checkheap(int line) {
-//     size_t block_number = 0;
-//     block_t *bp;
-//     // check prologue
-//     if (!extract_alloc(*find_prev_footer(heap_start)) ||
-//         extract_size(*find_prev_footer(heap_start)) != 0) {
-//         printf("---------------------\n");
-//         printf("Prologue Wrong at %d\n", line);
-//         return false;
-//     }
-//     // check block and coalesce
-//     for (bp = heap_start; get_size(bp) > 0; bp = find_next(bp)) {
-//         if (!check_block(bp, line)) {
-//             return false;
-//         }
-//         if (!check_coalesce(bp, line)) {
-//             return false;
-//         }
-//         block_number++;
-//     }
-//     // check epilogue
-//     if ((get_size(bp) != wsize) || !(get_alloc(bp))) {
-//         printf("---------------------\n");
-//         printf("Epilogue Wrong at %d\n", line);
-//         return false;
-//     }
-//     // check free segregate list
-//     if (!check_freelist(block_number, line)) {
-//         return false;
-//     }
-//     // check boundry
-//     if (!check_boundry(heap_start - 1, bp, line)) {
-//         return false;
-//     }
-//     return true;
-// }
-
-bool mm_checkheap(int line) {
+static bool check_segment(segment_t *segment, size_t *free_number) {
+    word_t prologue_footer = segment->prologue;
+    block_t *block = (block_t *)((char *)segment + sizeof(segment_t));
 
-    word_t prologue_footer;
-    block_t *block = heap_start;
-    prologue_footer = *(find_prev_footer(heap_start));
-
-    // printf("Heap (%p):\n", heap_start);
     // prologue
     if (extract_size(prologue_footer) != 0 ||
         extract_alloc(prologue_footer) != 1) {
@@ -1023,9 +2373,8 @@ bool mm_checkheap(int line) {
 
     // check each block
     bool pre_alloc_flag = 1;
-    for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
-
-        // if(line) print_block(block);
+    size_t pre_size = 0;
+    for (; get_size(block) > 0; block = find_next(block)) {
         size_t size = get_size(block);
         if ((size % dsize) != 0) {
             printf("###########################################################"
@@ -1051,10 +2400,13 @@ bool mm_checkheap(int line) {
                        "########\n");
                 return false;
             }
+            (*free_number)++;
         }
-        // check no free blocks are consecutive
+        // check no free blocks are consecutive, unless together they are
+        // too large for a header
 
-        if (get_alloc(block) == 0 && pre_alloc_flag == 0) {
+        if (get_alloc(block) == 0 && pre_alloc_flag == 0 &&
+            pre_size + size <= max_block_size) {
             printf("###########################################################"
                    "########\n");
             printf("Error: free blocks are consecutive\n");
@@ -1062,189 +2414,1998 @@ bool mm_checkheap(int line) {
                    "########\n");
             return false;
         }
+        if (get_prev_alloc(block) != pre_alloc_flag) {
+            printf("###########################################################"
+                   "########\n");
+            printf("Error: prev alloc bit of %p is wrong\n", block);
+            printf("###########################################################"
+                   "########\n");
+            return false;
+        }
         pre_alloc_flag = get_alloc(block);
+        pre_size = size;
     }
     // epilogue
-    if ((get_size(block) != min_block_size) &&
-        (extract_size(block->header) != 0 ||
-         extract_alloc(block->header) != 1)) {
+    if (extract_size(block->header) != 0 || extract_alloc(block->header) != 1) {
         printf("###############################################################"
                "####\n");
         printf("Bad epilogue header\n");
         printf("size=%lu\n", extract_size(block->header));
         printf("alloc=%d\n", extract_alloc(block->header));
         printf("pre_mini=%d\n", get_prev_mini(block));
-        // TODO: mem_heap_hi() 与epligue关系，而且还可能有错
         printf("%p\n", mem_heap_hi());
         printf("%p\n", block);
         printf("###############################################################"
                "####\n");
         return false;
     }
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: check every segment and every free list of an arena
+ * @arguments: the arena; the number of the line in code
+ * @preconditions: the caller owns the arena (holds its lock in arena mode)
+ * @param[in] arena
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+static bool check_arena(arena_t *arena, int line) {
+    if (!check_slabs(arena, line) || !check_unsorted(arena, line)) {
+        return false;
+    }
+    size_t free_number = 0;
+    for (segment_t *segment = arena->segments; segment != NULL;
+         segment = segment->next) {
+        if (!check_segment(segment, &free_number)) {
+            printf("Heap check failed at %d\n", line);
+            return false;
+        }
+    }
     // check free segregate list
-    if (!check_freelist(0, line)) {
+    if (!check_freelist(arena, free_number, line)) {
         return false;
     }
-
     return true;
 }
 
 /**
  * @brief
  *
- * @functions: mm_init initialize the heap
- * @arguments: NULL
- * @preconditions: NULL
- * @return true if the heap initialize successfully
+ * @functions: check the slabs with free slots of an arena: each one is marked
+ * in the slab map, sits in an allocated block of slab_size bytes, and its
+ * free count matches its bitmap, which has no bit past the last slot
+ * @arguments: the arena; the number of the line in code
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] line
+ * @return false if error occurs; otherwise true
  */
-bool mm_init(void) {
-
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1) {
-        return false;
+static bool check_slabs(arena_t *arena, int line) {
+    for (size_t i = 0; i < slab_classes; i++) {
+        slab_t *prev = NULL;
+        for (slab_t *slab = arena->slabs[i]; slab != NULL;
+             slab = slab->next) {
+            block_t *block = payload_to_header(slab);
+            size_t slots = slab_slots(slab->slot_size);
+            size_t count = 0;
+            bool stray = false;
+            for (size_t w = 0; w < slab_map_words; w++) {
+                uint64_t bits = slab->free_map[w];
+                count += (size_t)__builtin_popcountll(bits);
+                if (64 * (w + 1) > slots) {
+                    size_t valid = slots > 64 * w ? slots - 64 * w : 0;
+                    stray |= valid < 64 && (bits >> valid) != 0;
+                }
+            }
+            if (find_slab(slab) != slab || !get_alloc(block) ||
+                get_size(block) != slab_size || slab->arena != arena ||
+                slab->slot_size != (i + 1) * dsize || slab->prev != prev ||
+                slab->nr_free == 0 || count != slab->nr_free || stray) {
+                printf("---------------------\n");
+                printf("Bad slab %p at %d\n", (void *)slab, line);
+                return false;
+            }
+            prev = slab;
+        }
     }
+    return true;
+}
 
-    start[0] = pack(0, true, true, false); // Heap prologue (block footer)
-    start[1] = pack(0, true, true, false); // Heap epilogue (block header)
-
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-
-    // Initialize the seg_list
-    for (size_t i = 0; i < list_number; i++) {
-        seg_list[i] = NULL;
+/**
+ * @brief
+ *
+ * @functions: check the unsorted bin of an arena: every parked block is
+ * allocated, lies in the arena and is counted
+ * @arguments: the arena; the number of the line in code
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+static bool check_unsorted(arena_t *arena, int line) {
+    size_t number = 0;
+    for (block_t *block = arena->unsorted; block != NULL;
+         block = block->info.free_block.next) {
+        if (!check_boundry(block, block, line) || !get_alloc(block) ||
+            get_mapped(block) || block_arena(block) != arena) {
+            printf("---------------------\n");
+            printf("Bad block in unsorted bin at %d\n", line);
+            return false;
+        }
+        number++;
     }
-
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
+    if (number != arena->nr_unsorted) {
+        printf("---------------------\n");
+        printf("Unsorted bin count doesn't match at %d\n", line);
         return false;
     }
-
     return true;
 }
 
 /**
  * @brief
  *
- * @functions: malloc to alloc the block in the heap
- * @arguments: the size of the block we need to assign
+ * @functions: check the thread cache of the calling thread: every cached block
+ * is allocated, lies in the heap and has the size of its bin
+ * @arguments: the number of the line in code
  * @preconditions: NULL
- * @param[in] size
- * @return return the block pointer of the block we assign
+ * @param[in] line
+ * @return false if error occurs; otherwise true
  */
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
-
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
-    }
-
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+static bool check_tcache(int line) {
+    if (tcache.epoch != heap_epoch) {
+        return true;
     }
-
-    // Adjust block size to include overhead and to meet alignment requirements
-    asize = round_up(size + wsize, dsize);
-
-    // if (asize < dsize * 2) {
-    //     asize = 2 * dsize;
-    // }
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
+    for (size_t bin = 0; bin < tcache_bins; bin++) {
+        size_t number = 0;
+        for (block_t *block = tcache.entries[bin]; block != NULL;
+             block = block->info.free_block.next) {
+            if (!check_boundry(block, block, line) || !get_alloc(block) ||
+                get_size(block) != (bin + 1) * dsize) {
+                printf("---------------------\n");
+                printf("Bad block in thread cache at %d\n", line);
+                return false;
+            }
+            number++;
+        }
+        if (number != tcache.counts[bin]) {
+            printf("---------------------\n");
+            printf("Thread cache count doesn't match at %d\n", line);
+            return false;
         }
     }
-
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Try to split the block if too large
-    split_block(block, asize);
-
-    bp = header_to_payload(block);
-
-    dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+    return true;
 }
 
 /**
  * @brief
  *
- * @functions: free to free the allocated block
- * @arguments: the block pointer
- * @return NULL
- * @preconditions: NULL
- *
+ * @functions: check the size given to mm_free_sized against the block: the
+ * slot size of a slot, the region of a mapped block, or else the header,
+ * which must hold exactly the adjusted size
+ * @arguments: the pointer being freed; the size given with it; the number of
+ * the line in code
+ * @preconditions: bp is not NULL
  * @param[in] bp
+ * @param[in] size
+ * @param[in] line
+ * @return false if error occurs; otherwise true
  */
-void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
+static bool check_free_size(void *bp, size_t size, int line) {
+    slab_t *slab = find_slab(bp);
+    block_t *block = payload_to_header(bp);
+    bool ok;
+    if (slab != NULL) {
+        ok = (size <= slab->slot_size && slab->slot_size - dsize < size);
+    } else if (!get_alloc(block)) {
+        ok = false;
+    } else if (get_mapped(block)) {
+        ok = (size != 0 && size <= get_payload_size(block));
+    } else {
+        ok = (size != 0 &&
+              get_size(block) == round_up(size + block_overhead, dsize));
+    }
+    if (!ok) {
+        printf("---------------------\n");
+        printf("Freed size %zu doesn't match block %p at %d\n", size, bp,
+               line);
+        return false;
+    }
+    return true;
+}
 
-    if (bp == NULL) {
-        return;
+/**
+ * @brief
+ *
+ * @functions: check that a free block is linked where insert_block put it:
+ * its class is marked in the list map, and its list or tree neighbours point
+ * back to it. The mini list is singly linked and only has its map bit checked
+ * @arguments: the arena; the free block; the number of the line in code
+ * @preconditions: the block is free
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+static bool check_linked(arena_t *arena, block_t *block, int line) {
+    size_t index = get_index(get_size(block));
+    bool ok = (arena->list_map >> index) & 1;
+    if (ok && index == list_number - 1) {
+        block_t *parent = block->info.tree_node.parent;
+        block_t *left = block->info.tree_node.left;
+        block_t *right = block->info.tree_node.right;
+        ok = (parent == NULL ? arena->seg_list[index] == block
+                             : (parent->info.tree_node.left == block ||
+                                parent->info.tree_node.right == block)) &&
+             (left == NULL || (left->info.tree_node.parent == block &&
+                               tree_less(left, block))) &&
+             (right == NULL || (right->info.tree_node.parent == block &&
+                                tree_less(block, right)));
+    } else if (ok && index != 0) {
+        block_t *prev = block->info.free_block.prev;
+        block_t *next = block->info.free_block.next;
+        ok = (prev == NULL ? arena->seg_list[index] == block
+                           : prev->info.free_block.next == block) &&
+             (next == NULL || next->info.free_block.prev == block);
+    }
+    if (!ok) {
+        printf("---------------------\n");
+        printf("Free block %p not linked in its list at %d\n", (void *)block,
+               line);
+        return false;
     }
+    return true;
+}
 
-    block_t *block = payload_to_header(bp);
+/**
+ * @brief
+ *
+ * @functions: check one block on its own: bounds, alignment, the footer and
+ * the free list links of a free block, no free neighbour, and the prev_alloc
+ * bit of the next block. An epilogue only has to be allocated
+ * @arguments: the arena; the block; the number of the line in code
+ * @preconditions: the block starts a block of the arena
+ * @param[in] arena
+ * @param[in] block
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+static bool check_local(arena_t *arena, block_t *block, int line) {
     size_t size = get_size(block);
+    if (!check_boundry(block, block, line)) {
+        return false;
+    }
+    if (size == 0) {
+        if (!get_alloc(block)) {
+            printf("---------------------\n");
+            printf("Bad epilogue %p at %d\n", (void *)block, line);
+            return false;
+        }
+        return true;
+    }
+    if (size % dsize != 0 || size < min_block_size ||
+        (char *)block + size > (char *)mem_heap_hi()) {
+        printf("---------------------\n");
+        printf("Bad size %zu of %p at %d\n", size, (void *)block, line);
+        return false;
+    }
+    if (get_prev_alloc(find_next(block)) != get_alloc(block)) {
+        printf("---------------------\n");
+        printf("Prev alloc bit after %p wrong at %d\n", (void *)block, line);
+        return false;
+    }
+    if (get_alloc(block)) {
+        return true;
+    }
+    word_t footer = *header_to_footer(block);
+    if (size != min_block_size &&
+        (extract_size(footer) != size || extract_alloc(footer))) {
+        printf("---------------------\n");
+        printf("Header of %p does not match footer at %d\n", (void *)block,
+               line);
+        return false;
+    }
+    block_t *next = find_next(block);
+    block_t *prev = NULL;
+    if (!get_prev_alloc(block)) {
+        prev = get_prev_mini(block) ? find_prev_mini(block) : find_prev(block);
+    }
+    if ((!get_alloc(next) && size + get_size(next) <= max_block_size) ||
+        (prev != NULL && size + get_size(prev) <= max_block_size)) {
+        printf("---------------------\n");
+        printf("Free neighbours of %p not coalesced at %d\n", (void *)block,
+               line);
+        return false;
+    }
+    return check_linked(arena, block, line);
+}
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-
-    // Mark the block as free
-    bool prev_alloc = get_prev_alloc(block);
-    bool prev_mini = get_prev_mini(block);
-    write_header(block, size, false, prev_alloc, prev_mini);
+/**
+ * @brief
+ *
+ * @functions: check the blocks whose header was written since the last call,
+ * each with its neighbours, in O(1) per block. An address logged earlier may
+ * have been merged into a block logged after it, or trimmed off the heap: in
+ * address order, the entries that fall inside a block already checked, or
+ * past the break, are no block anymore and are skipped
+ * @arguments: the number of the line in code
+ * @preconditions: single arena mode, no entry was lost
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+static bool check_touched(int line) {
+    // Empty the log up front so an error does not leave stale entries
+    size_t count = nr_touched;
+    nr_touched = 0;
+    for (size_t i = 1; i < count; i++) {
+        block_t *block = touched[i];
+        size_t j = i;
+        for (; j > 0 && touched[j - 1] > block; j--) {
+            touched[j] = touched[j - 1];
+        }
+        touched[j] = block;
+    }
 
-    if (size != min_block_size) {
-        write_footer(block, size, false, prev_alloc, prev_mini);
-        set_nextblock_prev_alloc(block, false, false);
-        block = coalesce_block(block);
-        return;
+    char *end = NULL;
+    for (size_t i = 0; i < count; i++) {
+        block_t *block = touched[i];
+        if ((char *)block < end ||
+            (char *)block + wsize > (char *)mem_heap_hi() + 1) {
+            continue;
+        }
+        size_t size = get_size(block);
+        end = (char *)block + max(size, wsize);
+        if (!check_local(main_arena, block, line)) {
+            return false;
+        }
+        if (size == 0) {
+            continue;
+        }
+        if (!check_local(main_arena, find_next(block), line)) {
+            return false;
+        }
+        if (!get_prev_alloc(block)) {
+            block_t *prev = get_prev_mini(block) ? find_prev_mini(block)
+                                                 : find_prev(block);
+            if (find_next(prev) != block ||
+                !check_local(main_arena, prev, line)) {
+                printf("---------------------\n");
+                printf("Bad block before %p at %d\n", (void *)block, line);
+                return false;
+            }
+        }
     }
-    set_nextblock_prev_alloc(block, false, true);
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-    return;
-    dbg_ensures(mm_checkheap(__LINE__));
+    return true;
 }
 
 /**
  * @brief
  *
- * @functions: the implement of the realloc
- * @arguments: the block pointer and the size we need to assign
- * @preconditions: the pointer *ptr should be pointing at a block that has been
- * called malloc but has not been freed
- * @return NULL
- * @param[in] ptr
- * @param[in] size
+ * @functions: count a heap check and tell whether it may be incremental:
+ * check_interval is set, the build logs the written blocks, there is a single
+ * arena, the log is complete and no full sweep is due. Otherwise the log is
+ * emptied for the sweep that follows
+ * @arguments: NULL
+ * @preconditions: NULL
+ * @return true if only the logged blocks need checking
  */
-void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
-        return NULL;
+static bool check_incremental(void) {
+    if (check_interval != 0 && touch_logged && !arena_mode &&
+        !touch_overflow && ++checks_since_sweep < check_interval) {
+        return true;
+    }
+    checks_since_sweep = 0;
+    nr_touched = 0;
+    touch_overflow = false;
+    return false;
+}
+
+/**
+ * @brief
+ *
+ * @functions: the check_arena of the contracts inside the allocator, which
+ * is incremental like mm_checkheap
+ * @arguments: the arena; the number of the line in code
+ * @preconditions: the caller owns the arena
+ * @param[in] arena
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+static bool check_arena_step(arena_t *arena, int line) {
+    if (check_incremental()) {
+        return check_touched(line);
+    }
+    return check_arena(arena, line);
+}
+
+/**
+ * @brief
+ *
+ * @functions: check the thread cache, then the prologue, block, coalesce,
+ * epilogue and boundry of the heap, for every arena. With check_interval
+ * set, a debug build with a single arena does that once every
+ * check_interval calls, and only checks the blocks written since the last
+ * call in between
+ * @arguments: the number of the line in code
+ * @preconditions: must not be called while holding an arena lock
+ * @param[in] line
+ * @return false if error occurs; otherwise true
+ */
+bool mm_checkheap(int line) {
+    // Between sweeps, only look at what the last operations wrote
+    if (check_incremental()) {
+        return check_touched(line);
+    }
+
+    if (!check_tcache(line)) {
+        return false;
+    }
+    if (!arena_mode) {
+        return check_arena(main_arena, line);
+    }
+
+    heap_lock_acquire();
+    size_t count = nr_arenas;
+    heap_lock_release();
+
+    for (size_t i = 0; i < count; i++) {
+        arena_lock(arenas[i]);
+        bool ok = check_arena(arenas[i], line);
+        arena_unlock(arenas[i]);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: create an arena: its state, followed by a first segment holding
+ * one free block of chunksize bytes
+ * @arguments: NULL
+ * @preconditions: the heap lock is held in arena mode
+ * @return the new arena, NULL if the heap is exhausted
+ */
+static arena_t *arena_create(void) {
+    size_t arena_size = round_up(sizeof(arena_t), dsize);
+    size_t got;
+    char *start =
+        heap_sbrk(nr_arenas, arena_size + segment_overhead + chunksize, &got);
+    if (start == NULL) {
+        return NULL;
+    }
+
+    arena_t *arena = (arena_t *)start;
+    for (size_t i = 0; i < list_number; i++) {
+        arena->seg_list[i] = NULL;
+    }
+    arena->list_map = 0;
+    arena->segments = NULL;
+    arena->grow = chunksize;
+    for (size_t i = 0; i < slab_classes; i++) {
+        arena->slabs[i] = NULL;
+    }
+    arena->unsorted = NULL;
+    arena->nr_unsorted = 0;
+    arena->id = nr_arenas;
+    if (arena_mode) {
+        pthread_mutex_init(&arena->lock, NULL);
+        arenas[arena->id] = arena;
+    }
+
+    block_t *block = add_segment(arena, start + arena_size, got - arena_size);
+    arena->seg_end = start + got;
+    insert_block(arena, block);
+    nr_arenas++;
+    return arena;
+}
+
+/**
+ * @brief
+ *
+ * @functions: find the arena of the calling thread, binding the thread to an
+ * arena on its first call after mm_init. The first threads get their own
+ * arena until MM_ARENA_MAX is reached, later ones share them round-robin
+ * @arguments: NULL
+ * @preconditions: mm_init has been called
+ * @return the arena the thread allocates from
+ */
+static arena_t *thread_get_arena(void) {
+    if (!arena_mode) {
+        return main_arena;
+    }
+    if (thread_epoch == heap_epoch) {
+        return thread_arena;
+    }
+
+    heap_lock_acquire();
+    size_t slot = nr_bound++;
+    arena_t *arena = NULL;
+    if (slot < nr_arenas) {
+        arena = arenas[slot];
+    } else if (slot < arena_slots) {
+        arena = arena_create();
+    }
+    if (arena == NULL) {
+        arena = arenas[slot % nr_arenas];
+    }
+    heap_lock_release();
+
+    thread_arena = arena;
+    thread_epoch = heap_epoch;
+    return arena;
+}
+
+/**
+ * @brief
+ *
+ * @functions: give an allocated block back to the arena that owns it, which
+ * is not always the arena of the calling thread. The block is parked in the
+ * unsorted bin, which is consolidated once it holds unsorted_max blocks
+ * @arguments: the allocated block
+ * @preconditions: no arena lock is held by the caller
+ * @param[in] block
+ */
+static void release_block(block_t *block) {
+    arena_t *arena = block_arena(block);
+    arena_lock(arena);
+    if (unsorted_max == 0) {
+        free_block(arena, block);
+    } else {
+        block->info.free_block.next = arena->unsorted;
+        arena->unsorted = block;
+        if (++arena->nr_unsorted >= unsorted_max) {
+            consolidate(arena);
+        }
+    }
+    arena_unlock(arena);
+}
+
+/**
+ * @brief
+ *
+ * @functions: sort a list of allocated blocks linked through their first
+ * payload word by address, with a merge sort
+ * @arguments: the first block of the list
+ * @preconditions: NULL
+ * @param[in] list
+ * @return the first block of the sorted list
+ */
+static block_t *sort_by_address(block_t *list) {
+    if (list == NULL || list->info.free_block.next == NULL) {
+        return list;
+    }
+
+    // Split the list in two halves
+    block_t *slow = list;
+    for (block_t *fast = list->info.free_block.next;
+         fast != NULL && fast->info.free_block.next != NULL;
+         fast = fast->info.free_block.next->info.free_block.next) {
+        slow = slow->info.free_block.next;
+    }
+    block_t *second = slow->info.free_block.next;
+    slow->info.free_block.next = NULL;
+    block_t *a = sort_by_address(list);
+    block_t *b = sort_by_address(second);
+
+    // Merge them back
+    block_t *head = NULL;
+    block_t **tail = &head;
+    while (a != NULL && b != NULL) {
+        block_t **low = (a < b) ? &a : &b;
+        *tail = *low;
+        tail = &(*low)->info.free_block.next;
+        *low = (*low)->info.free_block.next;
+    }
+    *tail = (a != NULL) ? a : b;
+    return head;
+}
+
+/**
+ * @brief
+ *
+ * @functions: free a list of allocated blocks sorted by address. Each run of
+ * neighbours becomes one block before it is freed and coalesced
+ * @arguments: the arena owning the blocks; the first block of the list
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] block
+ */
+static void free_sorted(arena_t *arena, block_t *block) {
+    while (block != NULL) {
+        // Absorb the parked blocks right after this one
+        block_t *next = block->info.free_block.next;
+        block_t *end = find_next(block);
+        while (next == end &&
+               (size_t)((char *)end - (char *)block) + get_size(end) <=
+                   max_block_size) {
+            next = next->info.free_block.next;
+            end = find_next(end);
+        }
+        size_t size = (size_t)((char *)end - (char *)block);
+        write_header(block, size, true, get_prev_alloc(block),
+                     get_prev_mini(block));
+        free_block(arena, block);
+        block = next;
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: empty the unsorted bin of an arena into its free lists, in
+ * address order so that parked neighbours are merged first
+ * @arguments: the arena
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @return true if at least one block was freed
+ */
+static bool consolidate(arena_t *arena) {
+    block_t *block = sort_by_address(arena->unsorted);
+    if (block == NULL) {
+        return false;
+    }
+    arena->unsorted = NULL;
+    arena->nr_unsorted = 0;
+    free_sorted(arena, block);
+    dbg_ensures(check_arena_step(arena, __LINE__));
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: mark an allocated block free and put it back in the free lists
+ * of its arena, coalesced with its neighbours
+ * @arguments: the arena owning the block; the allocated block
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] block
+ */
+static void free_block(arena_t *arena, block_t *block) {
+    size_t size = get_size(block);
+
+    // Mark the block as free
+    bool prev_alloc = get_prev_alloc(block);
+    bool prev_mini = get_prev_mini(block);
+    write_header(block, size, false, prev_alloc, prev_mini);
+
+    if (size != min_block_size) {
+        write_footer(block, size, false, prev_alloc, prev_mini);
+        set_nextblock_prev_alloc(block, false, false);
+    } else {
+        set_nextblock_prev_alloc(block, false, true);
+    }
+    // Try to coalesce the block with its neighbors, then give the end of the
+    // heap back if it grew large enough
+    trim_heap(arena, coalesce_block(arena, block));
+}
+
+/**
+ * @brief
+ *
+ * @functions: get the thread cache of the calling thread, emptying it first if
+ * its blocks belong to a heap from before the last mm_init
+ * @arguments: NULL
+ * @preconditions: NULL
+ * @return the thread cache
+ */
+static tcache_t *tcache_self(void) {
+    if (tcache.epoch != heap_epoch) {
+        for (size_t bin = 0; bin < tcache_bins; bin++) {
+            tcache.entries[bin] = NULL;
+            tcache.counts[bin] = 0;
+        }
+        tcache.epoch = heap_epoch;
+        // Give the cached blocks back when the thread exits
+        pthread_once(&tcache_key_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+    }
+    return &tcache;
+}
+
+/**
+ * @brief
+ *
+ * @functions: create the key whose destructor runs tcache_exit, once
+ * @arguments: NULL
+ * @preconditions: called through pthread_once
+ * @return NULL
+ */
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/**
+ * @brief
+ *
+ * @functions: flush the thread cache of an exiting thread, or its blocks
+ * would stay allocated for good
+ * @arguments: the cache, the value of tcache_key for the thread
+ * @preconditions: called by the exiting thread, no arena lock is held
+ * @param[in] cache
+ * @return NULL
+ */
+static void tcache_exit(void *cache) {
+    (void)cache;
+    tcache_flush();
+}
+
+/**
+ * @brief
+ *
+ * @functions: pop a cached block of exactly asize bytes. The block is still
+ * marked allocated, so it can be handed out as is
+ * @arguments: the adjusted size of the request
+ * @preconditions: asize is a multiple of dsize
+ * @param[in] asize
+ * @return the block, NULL if the bin is empty or asize is not cached
+ */
+static block_t *tcache_get(size_t asize) {
+    if (asize > tcache_max_size) {
+        return NULL;
+    }
+    tcache_t *cache = tcache_self();
+    size_t bin = asize / dsize - 1;
+    block_t *block = cache->entries[bin];
+    if (block != NULL) {
+        cache->entries[bin] = block->info.free_block.next;
+        cache->counts[bin]--;
+    }
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * @functions: push a block being freed onto the thread cache, leaving its
+ * header untouched. The size bits of an allocated block never change, so
+ * they can be read without the arena lock
+ * @arguments: the allocated block; its size
+ * @preconditions: the block is allocated and size is its size
+ * @param[in] block
+ * @param[in] size
+ * @return true if the block was cached, false if it must really be freed
+ */
+static bool tcache_put(block_t *block, size_t size) {
+    if (size > tcache_max_size) {
+        return false;
+    }
+    tcache_t *cache = tcache_self();
+    size_t bin = size / dsize - 1;
+    if (cache->counts[bin] >= tcache_count) {
+        return false;
+    }
+    block->info.free_block.next = cache->entries[bin];
+    cache->entries[bin] = block;
+    cache->counts[bin]++;
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: really free every block of the thread cache, so that they can
+ * coalesce with their neighbours before the heap has to grow
+ * @arguments: NULL
+ * @preconditions: no arena lock is held by the caller
+ * @return true if at least one block was released
+ */
+static bool tcache_flush(void) {
+    tcache_t *cache = tcache_self();
+    bool released = false;
+    for (size_t bin = 0; bin < tcache_bins; bin++) {
+        block_t *block = cache->entries[bin];
+        cache->entries[bin] = NULL;
+        cache->counts[bin] = 0;
+        while (block != NULL) {
+            block_t *next = block->info.free_block.next;
+            release_block(block);
+            block = next;
+            released = true;
+        }
+    }
+    return released;
+}
+
+/**
+ * @brief
+ *
+ * @functions: find the slab a pointer belongs to, if any, from the bit of its
+ * page in the slab map
+ * @arguments: a pointer returned by malloc
+ * @preconditions: NULL
+ * @param[in] bp
+ * @return the slab holding bp, NULL if bp is not in a slab
+ */
+static slab_t *find_slab(void *bp) {
+    uintptr_t lo = (uintptr_t)mem_heap_lo() / slab_size;
+    uintptr_t page = (uintptr_t)bp / slab_size;
+    if (page < lo || page - lo >= slab_map_pages) {
+        return NULL;
+    }
+    page -= lo;
+    if (!(slab_map[page / 64] & ((uint64_t)1 << (page % 64)))) {
+        return NULL;
+    }
+    return (slab_t *)((uintptr_t)bp & ~(uintptr_t)(slab_size - 1));
+}
+
+/**
+ * @brief
+ *
+ * @functions: grow the slab map of single arena mode so that it covers a
+ * page. The new, at least twice larger map is an allocated block of the
+ * arena and the old one is freed, so the map never moves the break and the
+ * memory it leaves behind coalesces like any other block
+ * @arguments: the arena; the page to cover, counted from the heap start
+ * @preconditions: not arena mode; the arena is locked
+ * @param[in] arena
+ * @param[in] page
+ * @return false if the heap is exhausted
+ */
+static bool slab_map_grow(arena_t *arena, size_t page) {
+    size_t pages = round_up(max(2 * slab_map_pages, page + 1), 8 * dsize);
+    size_t asize = round_up(pages / 8 + block_overhead, dsize);
+    block_t *block = obtain_block(arena, asize);
+    if (block == NULL) {
+        return false;
+    }
+    block = carve_aligned(arena, block, asize, dsize);
+
+    uint64_t *map = (uint64_t *)header_to_payload(block);
+    if (slab_map_pages != 0) {
+        memcpy(map, slab_map, slab_map_pages / 8);
+        free_block(arena, payload_to_header(slab_map));
+    }
+    memset((char *)map + slab_map_pages / 8, 0,
+           (pages - slab_map_pages) / 8);
+    slab_map = map;
+    slab_map_pages = pages;
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: set or clear the bit of a slab in the slab map. Outside arena
+ * mode the map is first grown if it does not cover the slab yet; the map of
+ * arena mode is fixed, since other threads read it unlocked
+ * @arguments: the arena of the slab; the slab; true to set the bit, false
+ * to clear it
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] slab
+ * @param[in] set
+ * @return false if the map could not cover the slab
+ */
+static bool slab_map_mark(arena_t *arena, slab_t *slab, bool set) {
+    size_t page = (uintptr_t)slab / slab_size -
+                  (uintptr_t)mem_heap_lo() / slab_size;
+    if (page >= slab_map_pages &&
+        (arena_mode || !slab_map_grow(arena, page))) {
+        return false;
+    }
+    heap_lock_acquire();
+    if (set) {
+        slab_map[page / 64] |= (uint64_t)1 << (page % 64);
+    } else {
+        slab_map[page / 64] &= ~((uint64_t)1 << (page % 64));
+    }
+    heap_lock_release();
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: unlink a slab from the list of slabs with free slots
+ * @arguments: the slab
+ * @preconditions: the slab is in its list; its arena is locked
+ * @param[in] slab
+ */
+static void slab_unlink(slab_t *slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        slab->arena->slabs[slab->slot_size / dsize - 1] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: link a slab at the front of the list of slabs with free slots
+ * @arguments: the slab
+ * @preconditions: the slab is not in its list; its arena is locked
+ * @param[in] slab
+ */
+static void slab_link(slab_t *slab) {
+    slab_t **head = &slab->arena->slabs[slab->slot_size / dsize - 1];
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+/**
+ * @brief
+ *
+ * @functions: returns the number of slots of a slab of the given slot size
+ * @arguments: the slot size
+ * @preconditions: NULL
+ * @param[in] slot_size
+ * @return the number of slots after the slab header
+ */
+static size_t slab_slots(size_t slot_size) {
+    return (slab_size - wsize - round_up(sizeof(slab_t), dsize)) / slot_size;
+}
+
+/**
+ * @brief
+ *
+ * @functions: create a slab with every slot free: a block of slab_size bytes
+ * of the arena whose payload starts on a slab_size boundary. The next block
+ * then starts on the next boundary too, so slabs carved one after the other
+ * leave no gap between them
+ * @arguments: the arena; the slot size of the slab
+ * @preconditions: the arena is locked
+ * @param[in] arena
+ * @param[in] slot_size
+ * @return the new slab, NULL if the heap is exhausted
+ */
+static slab_t *slab_create(arena_t *arena, size_t slot_size) {
+    size_t asize = slab_size;
+    block_t *block = obtain_block(arena, asize + slab_size - dsize);
+    if (block == NULL) {
+        return NULL;
+    }
+    block = carve_aligned(arena, block, asize, slab_size);
+    slab_t *slab = (slab_t *)header_to_payload(block);
+    if (!slab_map_mark(arena, slab, true)) {
+        free_block(arena, block);
+        return NULL;
+    }
+
+    size_t slots = slab_slots(slot_size);
+    slab->arena = arena;
+    slab->slot_size = slot_size;
+    slab->nr_free = slots;
+    for (size_t i = 0; i < slab_map_words; i++) {
+        size_t bits = slots > 64 * i ? min(slots - 64 * i, 64) : 0;
+        slab->free_map[i] = bits == 64 ? ~(uint64_t)0
+                                       : (((uint64_t)1 << bits) - 1);
+    }
+    slab_link(slab);
+    return slab;
+}
+
+/**
+ * @brief
+ *
+ * @functions: tell whether a request should take a slab slot: it is tiny,
+ * the slot is smaller than the block it would get in the heap, and the heap
+ * is already large enough that the slabs of each size will fill up
+ * @arguments: the requested size; the adjusted size of a heap block for it
+ * @preconditions: NULL
+ * @param[in] size
+ * @param[in] asize
+ * @return true if the request goes to a slab
+ */
+static bool slab_wanted(size_t size, size_t asize) {
+    return size <= slab_max_size && asize > round_up(size, dsize) &&
+           mem_heapsize() >= slab_min_heap;
+}
+
+/**
+ * @brief
+ *
+ * @functions: allocate a slot from the first slab with a free one, creating
+ * a slab when there is none
+ * @arguments: the arena; the requested size
+ * @preconditions: 0 < size <= slab_max_size; the arena is locked
+ * @param[in] arena
+ * @param[in] size
+ * @return the slot, NULL if the heap is exhausted
+ */
+static void *slab_alloc(arena_t *arena, size_t size) {
+    size_t slot_size = round_up(size, dsize);
+    slab_t *slab = arena->slabs[slot_size / dsize - 1];
+    if (slab == NULL) {
+        slab = slab_create(arena, slot_size);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t i = 0;
+    while (slab->free_map[i] == 0) {
+        i++;
+    }
+    size_t slot = 64 * i + (size_t)__builtin_ctzll(slab->free_map[i]);
+    slab->free_map[i] &= slab->free_map[i] - 1;
+    if (--slab->nr_free == 0) {
+        slab_unlink(slab);
+    }
+    return (char *)slab + round_up(sizeof(slab_t), dsize) + slot * slot_size;
+}
+
+/**
+ * @brief
+ *
+ * @functions: give a slot back to its slab. A slab that becomes empty goes
+ * back to the free lists of its arena at once: kept around, it would pin its
+ * page in the middle of free memory that could otherwise coalesce
+ * @arguments: the slab; the slot
+ * @preconditions: bp is an allocated slot of the slab; no arena lock is held
+ * by the caller
+ * @param[in] slab
+ * @param[in] bp
+ */
+static void slab_free(slab_t *slab, void *bp) {
+    arena_t *arena = slab->arena;
+    arena_lock(arena);
+    size_t offset = (size_t)((char *)bp - (char *)slab) -
+                    round_up(sizeof(slab_t), dsize);
+    size_t slot = offset / slab->slot_size;
+    dbg_assert(offset % slab->slot_size == 0);
+    dbg_assert(!(slab->free_map[slot / 64] & ((uint64_t)1 << (slot % 64))));
+
+    slab->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+    if (slab->nr_free++ == 0) {
+        slab_link(slab);
+    }
+    if (slab->nr_free == slab_slots(slab->slot_size)) {
+        slab_unlink(slab);
+        slab_map_mark(arena, slab, false);
+        free_block(arena, payload_to_header(slab));
+    }
+    arena_unlock(arena);
+}
+
+/**
+ * @brief
+ *
+ * @functions: returns the CLOCK_MONOTONIC time in nanoseconds
+ * @arguments: NULL
+ * @preconditions: NULL
+ * @return the time
+ */
+static uint64_t prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief
+ *
+ * @functions: hash a payload address into the live sample table; the low
+ * bits of the result pick a filter bucket
+ * @arguments: the payload address
+ * @preconditions: NULL
+ * @param[in] bp
+ * @return the hash
+ */
+static size_t prof_hash(const void *bp) {
+    uint64_t h = ((uint64_t)(uintptr_t)bp >> 4) * 0x9E3779B97F4A7C15;
+    return (size_t)(h >> 32);
+}
+
+/**
+ * @brief
+ *
+ * @functions: draw the number of bytes until the next sample of the calling
+ * thread, uniformly in [1, 2 * prof_rate] so that the mean is prof_rate and
+ * periodic request patterns cannot alias with the sampling
+ * @arguments: NULL
+ * @preconditions: prof_rate is not 0
+ * @return the number of bytes
+ */
+static size_t prof_interval(void) {
+    if (prof_seed == 0) {
+        prof_seed = (uint64_t)(uintptr_t)&prof_seed ^ prof_now();
+        prof_seed |= 1;
+    }
+    prof_seed ^= prof_seed << 13;
+    prof_seed ^= prof_seed >> 7;
+    prof_seed ^= prof_seed << 17;
+    return 1 + (size_t)(prof_seed % (2 * prof_rate));
+}
+
+/**
+ * @brief
+ *
+ * @functions: record a sample: its backtrace from the caller of the
+ * allocator on, and its entry in the live table
+ * @arguments: the payload; the requested size; the return address of the
+ * allocator entry point
+ * @preconditions: the caller holds no arena lock
+ * @param[in] bp
+ * @param[in] size
+ * @param[in] site
+ */
+static void prof_record(void *bp, size_t size, void *site) {
+    void *frames[prof_depth + 8];
+
+    // backtrace may allocate the first time it is called
+    prof_busy = true;
+    int n = backtrace(frames, (int)(prof_depth + 8));
+    prof_busy = false;
+
+    // Drop the frames inside the allocator, which end at the site
+    int first = 0;
+    while (first < n && frames[first] != site) {
+        first++;
+    }
+    if (first == n) {
+        frames[0] = site;
+        first = 0;
+        n = 1;
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    if (prof_nr == prof_capacity) {
+        prof_dropped++;
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+    prof_sample_t *sample = &prof_samples[prof_nr];
+    sample->addr = (uint64_t)(uintptr_t)bp;
+    sample->size = size;
+    sample->alloc_ns = prof_now();
+    sample->free_ns = 0;
+    sample->depth = 0;
+    for (int i = first; i < n && sample->depth < prof_depth; i++) {
+        sample->pcs[sample->depth++] = (uint64_t)(uintptr_t)frames[i];
+    }
+
+    size_t h = prof_hash(bp);
+    size_t slot = h & (prof_table_size - 1);
+    while (prof_table[slot] != 0) {
+        slot = (slot + 1) & (prof_table_size - 1);
+    }
+    prof_table[slot] = (uint32_t)(++prof_nr);
+    __atomic_add_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&prof_filter[h & (prof_filter_size - 1)], 1,
+                       __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/**
+ * @brief
+ *
+ * @functions: count an allocation against the sampling interval of the
+ * calling thread, and sample it when the interval runs out
+ * @arguments: the payload (NULL if the allocation failed); the requested
+ * size; the return address of the allocator entry point
+ * @preconditions: the caller holds no arena lock
+ * @param[in] bp
+ * @param[in] size
+ * @param[in] site
+ */
+static void prof_alloc(void *bp, size_t size, void *site) {
+    if (prof_rate == 0 || bp == NULL || prof_busy) {
+        return;
+    }
+    if (prof_countdown == 0) {
+        prof_countdown = prof_interval();
+    }
+    if (prof_countdown > size) {
+        prof_countdown -= size;
+        return;
+    }
+    prof_countdown = prof_interval();
+    prof_record(bp, size, site);
+}
+
+/**
+ * @brief
+ *
+ * @functions: end the sample of a block being freed, if it has one. The
+ * filter bucket of the address is read first, so that most frees never
+ * take the lock
+ * @arguments: the payload
+ * @preconditions: bp is still allocated, so that no other thread can have
+ * been given it
+ * @param[in] bp
+ */
+static void prof_free(void *bp) {
+    if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    size_t h = prof_hash(bp);
+    if (__atomic_load_n(&prof_filter[h & (prof_filter_size - 1)],
+                        __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    size_t slot = h & (prof_table_size - 1);
+    while (prof_table[slot] != 0 &&
+           prof_samples[prof_table[slot] - 1].addr != (uintptr_t)bp) {
+        slot = (slot + 1) & (prof_table_size - 1);
+    }
+    if (prof_table[slot] == 0) {
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+    prof_samples[prof_table[slot] - 1].free_ns = prof_now();
+    __atomic_sub_fetch(&prof_live, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&prof_filter[h & (prof_filter_size - 1)], 1,
+                       __ATOMIC_RELAXED);
+
+    // Shift back the entries that probed past the freed slot
+    size_t hole = slot;
+    for (slot = (slot + 1) & (prof_table_size - 1); prof_table[slot] != 0;
+         slot = (slot + 1) & (prof_table_size - 1)) {
+        size_t home = prof_hash((void *)(uintptr_t)
+                                    prof_samples[prof_table[slot] - 1].addr) &
+                      (prof_table_size - 1);
+        if (((slot - home) & (prof_table_size - 1)) >=
+            ((slot - hole) & (prof_table_size - 1))) {
+            prof_table[hole] = prof_table[slot];
+            hole = slot;
+        }
+    }
+    prof_table[hole] = 0;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/**
+ * @brief
+ *
+ * @functions: end every live sample, whose blocks are gone when the heap
+ * is reset by mm_init. The samples stay until the next dump
+ * @arguments: NULL
+ * @preconditions: no other thread uses the allocator
+ */
+static void prof_reset(void) {
+    pthread_mutex_lock(&prof_lock);
+    uint64_t now = prof_now();
+    for (size_t slot = 0; slot < prof_table_size; slot++) {
+        if (prof_table[slot] != 0) {
+            prof_samples[prof_table[slot] - 1].free_ns = now;
+            prof_table[slot] = 0;
+        }
+    }
+    for (size_t i = 0; i < prof_filter_size; i++) {
+        prof_filter[i] = 0;
+    }
+    prof_live = 0;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+/**
+ * @brief
+ *
+ * @functions: allocate a block in a mapped region of its own. The region
+ * starts with a padding word so that the payload stays 16-byte aligned,
+ * which records the length of the whole region
+ * @arguments: the adjusted size of the request
+ * @preconditions: no arena lock is held by the caller
+ * @param[in] asize
+ * @return the allocated block, NULL if the region could not be mapped
+ */
+static block_t *map_block(size_t asize) {
+    size_t size = round_up(asize + wsize, mem_pagesize());
+    heap_lock_acquire();
+    char *region = (char *)(mem_map(size));
+    heap_lock_release();
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    block_t *block = (block_t *)(region + wsize);
+    *(word_t *)region = size;
+    block->header = (uint32_t)(pack(0, true, true, false) | mapped_mask);
+    stat_add(&counters.mapped_size, size);
+    return block;
+}
+
+/**
+ * @brief
+ *
+ * @functions: free a block allocated by map_block, giving its whole region
+ * back to the system
+ * @arguments: the mapped block
+ * @preconditions: the block is allocated and mapped
+ * @param[in] block
+ */
+static void unmap_block(block_t *block) {
+    size_t size = get_mapped_size(block);
+    heap_lock_acquire();
+    mem_unmap((char *)block - wsize, size);
+    heap_lock_release();
+    stat_sub(&counters.mapped_size, size);
+}
+
+/**
+ * @brief
+ *
+ * @functions: mm_init initialize the heap
+ * @arguments: NULL
+ * @preconditions: NULL
+ * @return true if the heap initialize successfully
+ */
+bool mm_init(void) {
+    heap_epoch++;
+    nr_arenas = 0;
+    nr_bound = 0;
+    arena_mode = (arena_max > 1);
+    arena_slots = arena_max;
+    arenas = NULL;
+    arena_map = NULL;
+    slab_map = NULL;
+    slab_map_pages = 0;
+    memset(&counters, 0, sizeof(counters));
+    prof_reset();
+    nr_touched = 0;
+    touch_overflow = false;
+    checks_since_sweep = 0;
+
+    // In arena mode, the arena table, the ownership map and a slab map
+    // covering the same range come first
+    if (arena_mode) {
+        size_t pages = arena_map_size * (arena_grain / slab_size);
+        size_t size = round_up(arena_slots * sizeof(arena_t *) +
+                                   arena_map_size + pages / 8,
+                               dsize);
+        char *start = (char *)(mem_sbrk(size));
+        if (start == (void *)-1) {
+            return false;
+        }
+        arenas = (arena_t **)start;
+        arena_map = (uint8_t *)(start + arena_slots * sizeof(arena_t *));
+        memset(arena_map, 0, arena_map_size);
+        slab_map = (uint64_t *)(arena_map + arena_map_size);
+        slab_map_pages = pages;
+        memset(slab_map, 0, pages / 8);
+    }
+
+    // Create the main arena with a free block of chunksize bytes
+    main_arena = arena_create();
+    if (main_arena == NULL) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: set a tunable parameter of the allocator
+ * @arguments: the parameter (MM_ARENA_MAX, ...) and its new value
+ * @preconditions: MM_ARENA_MAX takes effect at the next mm_init
+ * @param[in] param
+ * @param[in] value
+ * @return false if the parameter or value is not supported
+ */
+bool mm_mallopt(int param, long value) {
+    switch (param) {
+    case MM_ARENA_MAX:
+        if (value < 1 || (size_t)value > arena_limit) {
+            return false;
+        }
+        arena_max = (size_t)value;
+        return true;
+    case MM_FIT_DEPTH:
+        if (value < 0) {
+            return false;
+        }
+        fit_depth = (size_t)value;
+        return true;
+    case MM_TCACHE_COUNT:
+        if (value < 0 || (size_t)value > tcache_count_limit) {
+            return false;
+        }
+        tcache_count = (size_t)value;
+        return true;
+    case MM_UNSORTED_MAX:
+        if (value < 0) {
+            return false;
+        }
+        unsorted_max = (size_t)value;
+        return true;
+    case MM_MMAP_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        mmap_threshold = (size_t)value;
+        return true;
+    case MM_TRIM_THRESHOLD:
+        if (value < 0) {
+            return false;
+        }
+        trim_threshold = (size_t)value;
+        return true;
+    case MM_PROFILE_RATE:
+        if (value < 0) {
+            return false;
+        }
+        prof_rate = (size_t)value;
+        prof_countdown = 0;
+        return true;
+    case MM_CHECK_INTERVAL:
+        if (value < 0) {
+            return false;
+        }
+        check_interval = (size_t)value;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief
+ *
+ * @functions: copy the statistics kept since the last mm_init. The counters
+ * are read one by one, so with several threads running they may be slightly
+ * out of step with each other
+ * @arguments: where to store the statistics
+ * @preconditions: NULL
+ * @param[out] stats
+ * @return false if mm.c was built without MM_STATS
+ */
+bool mm_get_stats(mm_stats_t *stats) {
+    if (!MM_STATS) {
+        return false;
+    }
+    for (size_t i = 0; i < list_number; i++) {
+        mm_class_stats_t *c = &counters.classes[i];
+        stats->classes[i].allocs =
+            __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+        stats->classes[i].frees = __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+        stats->classes[i].splits =
+            __atomic_load_n(&c->splits, __ATOMIC_RELAXED);
+        stats->classes[i].coalesces =
+            __atomic_load_n(&c->coalesces, __ATOMIC_RELAXED);
+        stats->classes[i].fit_calls =
+            __atomic_load_n(&c->fit_calls, __ATOMIC_RELAXED);
+        stats->classes[i].fit_probes =
+            __atomic_load_n(&c->fit_probes, __ATOMIC_RELAXED);
+    }
+    stats->bytes_in_use =
+        __atomic_load_n(&counters.bytes_in_use, __ATOMIC_RELAXED);
+    stats->peak_in_use =
+        __atomic_load_n(&counters.peak_in_use, __ATOMIC_RELAXED);
+    stats->mapped_size =
+        __atomic_load_n(&counters.mapped_size, __ATOMIC_RELAXED);
+    stats->extends = __atomic_load_n(&counters.extends, __ATOMIC_RELAXED);
+    stats->trims = __atomic_load_n(&counters.trims, __ATOMIC_RELAXED);
+    heap_lock_acquire();
+    stats->heap_size = mem_heapsize();
+    heap_lock_release();
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * @functions: write the samples taken since the last dump to a file, with
+ * plain system calls so that the allocator is not reentered. The freed
+ * samples are then discarded and the live ones renumbered, which is the
+ * only time the table is rebuilt
+ * @arguments: the path of the file
+ * @preconditions: NULL
+ * @param[in] path
+ * @return false if the file cannot be written
+ */
+bool mm_profile_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    prof_header_t header = {
+        .magic = "MMPROF1",
+        .rate = prof_rate,
+        .nr_samples = prof_nr,
+        .dropped = prof_dropped,
+        .anchor = (uint64_t)(uintptr_t)&mm_init,
+        .dump_ns = prof_now(),
+    };
+    bool ok = true;
+    const char *buf = (const char *)&header;
+    size_t left = sizeof(header);
+    for (int part = 0; ok && part < 2; part++) {
+        while (left > 0) {
+            ssize_t n = write(fd, buf, left);
+            if (n < 0) {
+                ok = false;
+                break;
+            }
+            buf += n;
+            left -= (size_t)n;
+        }
+        buf = (const char *)prof_samples;
+        left = prof_nr * sizeof(prof_sample_t);
+    }
+    if (close(fd) != 0) {
+        ok = false;
+    }
+
+    // Keep the live samples for the next dump
+    size_t live = 0;
+    for (size_t i = 0; i < prof_nr; i++) {
+        if (prof_samples[i].free_ns == 0) {
+            prof_samples[live++] = prof_samples[i];
+        }
+    }
+    prof_nr = live;
+    prof_dropped = 0;
+    memset(prof_table, 0, sizeof(prof_table));
+    for (size_t i = 0; i < prof_nr; i++) {
+        size_t slot = prof_hash((void *)(uintptr_t)prof_samples[i].addr) &
+                      (prof_table_size - 1);
+        while (prof_table[slot] != 0) {
+            slot = (slot + 1) & (prof_table_size - 1);
+        }
+        prof_table[slot] = (uint32_t)(i + 1);
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return ok;
+}
+
+/**
+ * @brief
+ *
+ * @functions: malloc to alloc the block in the heap
+ * @arguments: the size of the block we need to assign
+ * @preconditions: NULL
+ * @param[in] size
+ * @return return the block pointer of the block we assign
+ */
+void *malloc(size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t asize; // Adjusted block size
+    block_t *block;
+    void *bp = NULL;
+
+    // Initialize heap if it isn't initialized
+    if (main_arena == NULL) {
+        mm_init();
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    // Adjust block size to include overhead and to meet alignment requirements
+    asize = round_up(size + block_overhead, dsize);
+
+    // Huge blocks get a region of their own, the heap is the fallback up to
+    // the largest size a header holds
+    if ((mmap_threshold != 0 && asize >= mmap_threshold) ||
+        asize >= huge_size) {
+        block = map_block(asize);
+        if (block != NULL) {
+            stat_alloc(get_mapped_size(block));
+            bp = header_to_payload(block);
+            prof_alloc(bp, size, __builtin_return_address(0));
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+        if (asize >= huge_size) {
+            return NULL;
+        }
+    }
+
+    // Tiny requests take a slot of a slab, without a header
+    if (slab_wanted(size, asize)) {
+        arena_t *arena = thread_get_arena();
+        arena_lock(arena);
+        bp = slab_alloc(arena, size);
+        arena_unlock(arena);
+        if (bp != NULL) {
+            stat_alloc(round_up(size, dsize));
+            prof_alloc(bp, size, __builtin_return_address(0));
+            dbg_ensures(mm_checkheap(__LINE__));
+            return bp;
+        }
+    }
+
+    // A cached block of the exact size needs no search and no split
+    block = tcache_get(asize);
+    if (block != NULL) {
+        stat_alloc(asize);
+        bp = header_to_payload(block);
+        prof_alloc(bp, size, __builtin_return_address(0));
+        dbg_ensures(mm_checkheap(__LINE__));
+        return bp;
+    }
+
+    arena_t *arena = thread_get_arena();
+    arena_lock(arena);
+
+    // Search the free lists for a fit, extending the heap if there is none
+    block = obtain_block(arena, asize);
+    if (block == NULL) {
+        arena_unlock(arena);
+        return bp;
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Try to split the block if too large
+    split_block(arena, block, asize);
+    arena_unlock(arena);
+    stat_alloc(asize);
+
+    bp = header_to_payload(block);
+    prof_alloc(bp, size, __builtin_return_address(0));
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/**
+ * @brief
+ *
+ * @functions: free to free the allocated block. Small blocks are kept in the
+ * thread cache, the others are parked in the unsorted bin of the arena that
+ * owns them
+ * @arguments: the block pointer
+ * @return NULL
+ * @preconditions: NULL
+ *
+ * @param[in] bp
+ */
+void free(void *bp) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (bp == NULL) {
+        return;
+    }
+    prof_free(bp);
+
+    // A slot has no header, its slab is found from the address alone
+    slab_t *slab = find_slab(bp);
+    if (slab != NULL) {
+        stat_free(slab->slot_size);
+        slab_free(slab, bp);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // A mapped block is not in the heap, its region goes back right away
+    if (get_mapped(block)) {
+        stat_free(get_mapped_size(block));
+        unmap_block(block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    // Small blocks go to the thread cache, without coalescing
+    stat_free(get_size(block));
+    if (tcache_put(block, get_size(block))) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    release_block(block);
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief
+ *
+ * @functions: allocate a block whose payload is a multiple of alignment. A
+ * free block large enough for any placement is carved where the payload
+ * lands on the boundary, and the bytes skipped in front go back to the free
+ * lists. Slots and mapped regions only guarantee dsize, so the block is
+ * always taken from the heap
+ * @arguments: the alignment of the payload; the size of the block
+ * @preconditions: NULL
+ * @param[in] alignment
+ * @param[in] size
+ * @return the aligned payload, NULL if alignment is not a power of 2 or the
+ * heap is exhausted
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+    if (alignment <= dsize) {
+        return malloc(size);
+    }
+
+    // Initialize heap if it isn't initialized
+    if (main_arena == NULL) {
+        mm_init();
+    }
+
+    // Ignore spurious requests, and those too large for the heap
+    if (size == 0 || size >= huge_size || alignment >= huge_size) {
+        return NULL;
+    }
+    size_t asize = round_up(size + block_overhead, dsize);
+    if (asize + alignment - dsize >= huge_size) {
+        return NULL;
+    }
+
+    arena_t *arena = thread_get_arena();
+    arena_lock(arena);
+    block_t *block = obtain_block(arena, asize + alignment - dsize);
+    if (block == NULL) {
+        arena_unlock(arena);
+        return NULL;
+    }
+    block = carve_aligned(arena, block, asize, alignment);
+    arena_unlock(arena);
+    stat_alloc(asize);
+
+    void *bp = header_to_payload(block);
+    prof_alloc(bp, size, __builtin_return_address(0));
+    dbg_ensures((uintptr_t)bp % alignment == 0);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
+}
+
+/**
+ * @brief
+ *
+ * @functions: C11 aligned_alloc, which is mm_memalign once size is a
+ * multiple of alignment
+ * @arguments: the alignment of the payload; the size of the block
+ * @preconditions: NULL
+ * @param[in] alignment
+ * @param[in] size
+ * @return the aligned payload, NULL if the request is invalid or the heap is
+ * exhausted
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || size % alignment != 0) {
+        return NULL;
+    }
+    return mm_memalign(alignment, size);
+}
+
+/**
+ * @brief
+ *
+ * @functions: free a block whose size the caller knows. The size alone tells
+ * whether the block can be a slot and which thread cache bin it goes to, so
+ * neither the slab map nor the size bits are looked at when they need not be.
+ * Only the mapped bit is still read: realloc and mm_mallopt can leave a
+ * mapped block of any size
+ * @arguments: the block pointer; the size last requested for it by malloc,
+ * realloc or mm_malloc_batch
+ * @preconditions: bp was returned by malloc and not freed yet, or is NULL
+ * @param[in] bp
+ * @param[in] size
+ */
+void mm_free_sized(void *bp, size_t size) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (bp == NULL) {
+        return;
+    }
+    dbg_requires(check_free_size(bp, size, __LINE__));
+    prof_free(bp);
+
+    // Only a request that fits a slot can have been given one
+    if (size <= slab_max_size) {
+        slab_t *slab = find_slab(bp);
+        if (slab != NULL) {
+            stat_free(slab->slot_size);
+            slab_free(slab, bp);
+            dbg_ensures(mm_checkheap(__LINE__));
+            return;
+        }
+    }
+
+    block_t *block = payload_to_header(bp);
+    if (get_mapped(block)) {
+        stat_free(get_mapped_size(block));
+        unmap_block(block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    // A heap block has exactly the adjusted size of its request
+    size_t asize = round_up(size + block_overhead, dsize);
+    stat_free(asize);
+    if (tcache_put(block, asize)) {
+        dbg_ensures(mm_checkheap(__LINE__));
+        return;
+    }
+
+    release_block(block);
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief
+ *
+ * @functions: allocate n blocks of size bytes in one call. Tiny requests take
+ * their slots under a single lock; the others are cut back to back out of
+ * as few free blocks as possible, each leaving the free lists once
+ * @arguments: the size of every block; how many blocks; where to store the
+ * pointers to them
+ * @preconditions: ptrs has room for n pointers
+ * @param[in] size
+ * @param[in] n
+ * @param[out] ptrs
+ * @return the number of blocks allocated, less than n if the heap ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    dbg_requires(mm_checkheap(__LINE__));
+    size_t done = 0;
+
+    // Initialize heap if it isn't initialized
+    if (main_arena == NULL) {
+        mm_init();
+    }
+
+    // Ignore spurious request
+    if (size == 0) {
+        return done;
+    }
+
+    // Huge blocks get a region each anyway
+    size_t asize = round_up(size + block_overhead, dsize);
+    if ((mmap_threshold != 0 && asize >= mmap_threshold) ||
+        asize >= huge_size) {
+        for (; done < n; done++) {
+            ptrs[done] = malloc(size);
+            if (ptrs[done] == NULL) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    arena_t *arena = thread_get_arena();
+    arena_lock(arena);
+    if (slab_wanted(size, asize)) {
+        for (; done < n; done++) {
+            ptrs[done] = slab_alloc(arena, size);
+            if (ptrs[done] == NULL) {
+                break;
+            }
+            stat_alloc(round_up(size, dsize));
+        }
+    }
+
+    while (done < n) {
+        // A block that holds all the rest, else any block that holds one
+        size_t rest = n - done;
+        size_t want = (rest > SIZE_MAX / asize) ? SIZE_MAX : asize * rest;
+        block_t *block = find_fit(arena, want);
+        if (block == NULL) {
+            block = obtain_block(arena, asize);
+        }
+        if (block == NULL) {
+            break;
+        }
+
+        size_t count = min(rest, get_size(block) / asize);
+        split_batch(arena, block, asize, count);
+        for (size_t i = 0; i < count; i++) {
+            stat_alloc(get_size(block));
+            ptrs[done++] = header_to_payload(block);
+            block = find_next(block);
+        }
+    }
+    arena_unlock(arena);
+
+    if (prof_rate != 0) {
+        for (size_t i = 0; i < done; i++) {
+            prof_alloc(ptrs[i], size, __builtin_return_address(0));
+        }
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return done;
+}
+
+/**
+ * @brief
+ *
+ * @functions: free n blocks in one call. The heap blocks skip the thread
+ * cache and the unsorted bin: they are sorted by address, so each arena is
+ * locked once per run of its blocks and neighbours coalesce in one step
+ * @arguments: the pointers to free, NULL ones are skipped; how many
+ * @preconditions: every pointer was returned by malloc and not freed yet;
+ * the array itself is left untouched
+ * @param[in] ptrs
+ * @param[in] n
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Slots and mapped blocks go right away, the others are linked together
+    // through their first payload word
+    block_t *list = NULL;
+    for (size_t i = 0; i < n; i++) {
+        void *bp = ptrs[i];
+        if (bp == NULL) {
+            continue;
+        }
+        prof_free(bp);
+        slab_t *slab = find_slab(bp);
+        if (slab != NULL) {
+            stat_free(slab->slot_size);
+            slab_free(slab, bp);
+            continue;
+        }
+        block_t *block = payload_to_header(bp);
+        dbg_assert(get_alloc(block));
+        if (get_mapped(block)) {
+            stat_free(get_mapped_size(block));
+            unmap_block(block);
+            continue;
+        }
+        stat_free(get_size(block));
+        block->info.free_block.next = list;
+        list = block;
+    }
+
+    // In address order, the blocks of an arena come in runs
+    list = sort_by_address(list);
+    while (list != NULL) {
+        arena_t *arena = block_arena(list);
+        block_t *last = list;
+        while (last->info.free_block.next != NULL &&
+               block_arena(last->info.free_block.next) == arena) {
+            last = last->info.free_block.next;
+        }
+        block_t *rest = last->info.free_block.next;
+        last->info.free_block.next = NULL;
+
+        arena_lock(arena);
+        free_sorted(arena, list);
+        arena_unlock(arena);
+        list = rest;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief
+ *
+ * @functions: the implement of the realloc. The block is resized in place
+ * when its neighbours allow it, otherwise it is moved
+ * @arguments: the block pointer and the size we need to assign
+ * @preconditions: the pointer *ptr should be pointing at a block that has been
+ * called malloc but has not been freed
+ * @return NULL
+ * @param[in] ptr
+ * @param[in] size
+ */
+void *realloc(void *ptr, size_t size) {
+    block_t *block = payload_to_header(ptr);
+    size_t copysize;
+    void *newptr;
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        free(ptr);
+        return NULL;
     }
 
     // If ptr is NULL, then equivalent to malloc
@@ -1252,6 +4413,39 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    size_t asize = round_up(size + block_overhead, dsize);
+    slab_t *slab = find_slab(ptr);
+    if (slab != NULL) {
+        // A slot stays where it is while the request keeps its slot size
+        copysize = slab->slot_size;
+        if (size <= copysize && copysize - dsize < size) {
+            return ptr;
+        }
+    } else if (get_mapped(block)) {
+        // A mapped block stays where it is as long as its region holds the
+        // request and is not more than twice too large
+        copysize = get_payload_size(block);
+        if (size <= copysize && copysize / 2 <= size) {
+            return ptr;
+        }
+    } else {
+        // Try to grow or shrink the block where it is first. The owning
+        // arena's lock covers the neighbours and the header, which a
+        // neighbour being freed may rewrite
+        arena_t *arena = block_arena(block);
+        arena_lock(arena);
+        size_t old_size = get_size(block);
+        if (resize_block(arena, block, asize)) {
+            stat_sub(&counters.bytes_in_use, old_size);
+            stat_use(get_size(block));
+            arena_unlock(arena);
+            dbg_ensures(mm_checkheap(__LINE__));
+            return ptr;
+        }
+        copysize = get_payload_size(block); // gets size of old payload
+        arena_unlock(arena);
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
 
@@ -1261,7 +4455,6 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
     if (size < copysize) {
         copysize = size;
     }
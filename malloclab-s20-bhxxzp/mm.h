@@ -65,6 +65,144 @@ extern void *calloc(size_t nmemb, size_t size);
  */
 extern bool mm_init(void);
 
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, aligned to
+ *         `alignment` bytes.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of 2.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, NULL if
+ *          `alignment` is not a power of 2.
+ */
+extern void *mm_memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Same as mm_memalign, but `size` must be a multiple of `alignment`.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of 2.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, NULL if the
+ *          request is invalid.
+ */
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Marks an allocated block of known size as free.
+ *
+ * Faster than free when the caller knows the size, as with C++ sized
+ * deallocation. In debug builds the size is checked against the block.
+ *
+ * @param[in] ptr  A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size last requested for the block, by malloc, realloc
+ *                  or mm_malloc_batch.
+ */
+extern void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each in one call.
+ *
+ * @param[in] size  The minimum size of bytes of every block.
+ * @param[in] n  The number of blocks to allocate.
+ * @param[out] ptrs  An array of `n` pointers, set to the new blocks.
+ *
+ * @return  The number of blocks allocated; fewer than `n` only when the heap
+ *          is exhausted, and 0 when `size` is 0.
+ */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief  Free `n` blocks in one call.
+ *
+ * @param[in] ptrs  An array of `n` pointers to allocated payloads (or NULL),
+ *                  in any order. The array itself is not modified.
+ * @param[in] n  The number of pointers.
+ */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief  Parameters that can be tuned with mm_mallopt.
+ */
+enum {
+    MM_ARENA_MAX = 1, /* Max number of arenas (threads), applied by mm_init */
+    MM_TCACHE_COUNT = 2, /* Max blocks per thread cache bin, 0 disables it */
+    MM_FIT_DEPTH = 3,    /* Fitting blocks find_fit compares, 0 for all */
+    MM_MMAP_THRESHOLD = 4, /* Smallest request given its own region, 0 never */
+    MM_TRIM_THRESHOLD = 5, /* Free bytes at the heap end to give back, 0 never */
+    MM_UNSORTED_MAX = 6, /* Freed blocks parked before coalescing, 0 never */
+    MM_PROFILE_RATE = 7, /* Mean bytes between sampled requests, 0 never */
+    MM_CHECK_INTERVAL = 8, /* mm_checkheap calls per full sweep, 0 for all */
+};
+
+/**
+ * @brief  Set a tunable parameter of the allocator.
+ *
+ * @param[in] param  One of the MM_* parameters.
+ * @param[in] value  The new value of the parameter.
+ *
+ * @return  True on success, False if the parameter or value is not supported.
+ */
+extern bool mm_mallopt(int param, long value);
+
+/**
+ * @brief  Number of size classes reported by mm_get_stats.
+ */
+enum { MM_STATS_CLASSES = 48 };
+
+/**
+ * @brief  Counters of one size class. A block counts in the class of its
+ *         adjusted size, a request in the class of the size it asked for.
+ *         A block resized in place by realloc is freed in its new class.
+ */
+typedef struct {
+    size_t allocs;     /* Blocks handed out */
+    size_t frees;      /* Blocks given back */
+    size_t splits;     /* Requests that left a free remainder */
+    size_t coalesces;  /* Frees merged with a free neighbour */
+    size_t fit_calls;  /* Searches of the free lists */
+    size_t fit_probes; /* Free blocks looked at by those searches */
+} mm_class_stats_t;
+
+/**
+ * @brief  Allocator statistics since the last mm_init.
+ */
+typedef struct {
+    mm_class_stats_t classes[MM_STATS_CLASSES];
+    size_t bytes_in_use; /* Sizes of the allocated blocks, with overhead */
+    size_t peak_in_use;  /* Largest bytes_in_use seen */
+    size_t heap_size;    /* Bytes obtained with mem_sbrk */
+    size_t mapped_size;  /* Bytes in mapped regions */
+    size_t extends;      /* Heap extensions */
+    size_t trims;        /* Heap trims */
+} mm_stats_t;
+
+/**
+ * @brief  Read the allocator statistics.
+ *
+ * The counters are only kept when mm.c is built with MM_STATS=1
+ * ("make STATS=1"); otherwise they cost nothing and cannot be read.
+ *
+ * @param[out] stats  Where to store the statistics.
+ *
+ * @return  True on success, False if the statistics are compiled out.
+ */
+extern bool mm_get_stats(mm_stats_t *stats);
+
+/**
+ * @brief  Write the allocation samples to a file.
+ *
+ * With MM_PROFILE_RATE set, about one request in every that many bytes is
+ * sampled, with its size, its call stack and the times it was allocated and
+ * freed. This writes the samples taken since the last dump; the ones still
+ * live are kept for the next. The file is read by mm-prof.pl.
+ *
+ * @param[in] path  The file to write.
+ *
+ * @return  True on success, False if the file cannot be written.
+ */
+extern bool mm_profile_dump(const char *path);
+
 /* This is for debugging.  Returns false if error encountered */
 /**
  * @brief  Check the heap for inconsistencies.